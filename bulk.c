@@ -0,0 +1,158 @@
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif /* __SSE2__ */
+
+#include "bulk.h"
+
+/**
+ * enum
+ *
+ * @BULK_STREAM_SIZE: smallest copy or fill written with non-temporal
+ *                    stores, large enough to evict most of the cache if
+ *                    written through it
+ * @BULK_CHUNK_SIZE:  bytes handled per unrolled loop iteration
+ */
+enum {
+	BULK_STREAM_SIZE = 1 << 20,
+	BULK_CHUNK_SIZE  = 64,
+};
+
+#ifdef __SSE2__
+/**
+ * stream() - copy or fill memory with non-temporal stores
+ *
+ * Destination is aligned with a regular head copy, so that whole chunks
+ * can be streamed, and the tail is copied regularly as well.
+ *
+ * @dst:  destination
+ * @src:  source, or NULL to fill with zeroes
+ * @size: number of bytes, at least BULK_CHUNK_SIZE
+ */
+static void stream(uint8_t *dst, const uint8_t *src, size_t size)
+{
+	__m128i a, b, c, d;
+	size_t head;
+
+	head = -(uintptr_t) dst % 16;
+	if (src != NULL) {
+		memcpy(dst, src, head);
+		src += head;
+	} else {
+		memset(dst, 0, head);
+	}
+	dst += head;
+	size -= head;
+
+	a = b = c = d = _mm_setzero_si128();
+	for (/* NOTHING */; size >= BULK_CHUNK_SIZE;
+	     size -= BULK_CHUNK_SIZE, dst += BULK_CHUNK_SIZE) {
+		if (src != NULL) {
+			a = _mm_loadu_si128((const __m128i *) src);
+			b = _mm_loadu_si128((const __m128i *) src + 1);
+			c = _mm_loadu_si128((const __m128i *) src + 2);
+			d = _mm_loadu_si128((const __m128i *) src + 3);
+			src += BULK_CHUNK_SIZE;
+		}
+		_mm_stream_si128((__m128i *) dst, a);
+		_mm_stream_si128((__m128i *) dst + 1, b);
+		_mm_stream_si128((__m128i *) dst + 2, c);
+		_mm_stream_si128((__m128i *) dst + 3, d);
+	}
+
+	/* Streamed stores are weakly ordered */
+	_mm_sfence();
+
+	if (src != NULL)
+		memcpy(dst, src, size);
+	else
+		memset(dst, 0, size);
+}
+#endif /* __SSE2__ */
+
+/**
+ * bulk_copy() - copy memory, bypassing the cache for large copies
+ *
+ * Large copies, such as whole guest memory, would otherwise push
+ * everything else out of the cache for data that is not read back soon.
+ *
+ * @dst:  destination, not overlapping @src
+ * @src:  source
+ * @size: number of bytes
+ */
+void bulk_copy(void *dst, const void *src, size_t size)
+{
+	assert(size == 0 || (dst != NULL && src != NULL));
+
+#ifdef __SSE2__
+	if (size >= BULK_STREAM_SIZE) {
+		stream(dst, src, size);
+		return;
+	}
+#endif /* __SSE2__ */
+
+	memcpy(dst, src, size);
+}
+
+/**
+ * bulk_zero() - fill memory with zeroes, bypassing the cache for large
+ *               fills
+ *
+ * @dst:  destination
+ * @size: number of bytes
+ */
+void bulk_zero(void *dst, size_t size)
+{
+	assert(size == 0 || dst != NULL);
+
+#ifdef __SSE2__
+	if (size >= BULK_STREAM_SIZE) {
+		stream(dst, NULL, size);
+		return;
+	}
+#endif /* __SSE2__ */
+
+	memset(dst, 0, size);
+}
+
+/**
+ * bulk_is_zero() - check whether memory holds only zero bytes
+ *
+ * Words of a chunk are or'ed together without branching, which compilers
+ * turn into vector code, and only one test per chunk is left.
+ *
+ * @buf:  memory to check
+ * @size: number of bytes
+ *
+ * Return: non-zero if all bytes are zero
+ */
+int bulk_is_zero(const void *buf, size_t size)
+{
+	const uint8_t *p = buf;
+	uint64_t w[BULK_CHUNK_SIZE / 8], acc;
+	unsigned i;
+
+	assert(size == 0 || buf != NULL);
+
+	for (/* NOTHING */; size > 0 && (uintptr_t) p % 8 != 0; p++, size--)
+		if (*p != 0)
+			return 0;
+
+	for (/* NOTHING */; size >= BULK_CHUNK_SIZE;
+	     p += BULK_CHUNK_SIZE, size -= BULK_CHUNK_SIZE) {
+		memcpy(w, p, sizeof(w));
+		for (acc = 0, i = 0; i < BULK_CHUNK_SIZE / 8; i++)
+			acc |= w[i];
+		if (acc != 0)
+			return 0;
+	}
+
+	for (/* NOTHING */; size > 0; p++, size--)
+		if (*p != 0)
+			return 0;
+
+	return 1;
+}
@@ -0,0 +1,10 @@
+#ifndef _BULK_H
+#define _BULK_H
+
+#include <stddef.h>
+
+void bulk_copy(void *, const void *, size_t);
+void bulk_zero(void *, size_t);
+int bulk_is_zero(const void *, size_t);
+
+#endif /* _BULK_H */
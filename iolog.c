@@ -0,0 +1,238 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "iolog.h"
+#include "log.h"
+
+/**
+ * IOLOG_MAGIC - device input log file signature
+ */
+#define IOLOG_MAGIC "KVMIOLOG"
+
+/**
+ * enum
+ *
+ * @IOLOG_VERSION: device input log file format version
+ * @MAX_DATA:      maximum size of data of a single event
+ */
+enum {
+	IOLOG_VERSION = 1,
+	MAX_DATA      = 4096,
+};
+
+/**
+ * struct iolog_header - device input log file header, followed by events
+ *
+ * @magic:   IOLOG_MAGIC
+ * @version: IOLOG_VERSION
+ * @pad:     reserved, zero
+ */
+struct iolog_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t pad;
+};
+
+/**
+ * struct iolog_event - guest input event, followed by its data
+ *
+ * @exit: number of guest initiated exits preceding the event
+ * @addr: port number or MMIO guest physical address
+ * @type: IOLOG_* event type
+ * @size: size of data in bytes
+ */
+struct iolog_event {
+	uint64_t exit;
+	uint64_t addr;
+	uint32_t type;
+	uint32_t size;
+};
+
+/**
+ * struct iolog - device input log
+ *
+ * @path:       log file path
+ * @stream:     log file stream
+ * @mode:       IOLOG_RECORD or IOLOG_REPLAY
+ * @num_events: number of recorded or replayed events
+ */
+struct iolog {
+	const char *path;
+	FILE *stream;
+	int mode;
+	uint64_t num_events;
+};
+
+/**
+ * iolog_open() - open a device input log for recording or replaying
+ *
+ * @path: log file path
+ * @mode: IOLOG_RECORD or IOLOG_REPLAY
+ *
+ * Return: device input log, or NULL if an error occurred
+ */
+struct iolog *iolog_open(const char *path, int mode)
+{
+	struct iolog_header hdr;
+	struct iolog *log;
+
+	assert(path != NULL);
+	assert(mode == IOLOG_RECORD || mode == IOLOG_REPLAY);
+
+	log = calloc(1, sizeof(*log));
+	if (log == NULL) {
+		error("failed to allocate device input log");
+		return NULL;
+	}
+
+	log->path = path;
+	log->mode = mode;
+	log->stream = fopen(path, mode == IOLOG_RECORD ? "w" : "r");
+	if (log->stream == NULL) {
+		error("%s", path);
+		free(log);
+		return NULL;
+	}
+
+	if (mode == IOLOG_RECORD) {
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, IOLOG_MAGIC, sizeof(hdr.magic));
+		hdr.version = IOLOG_VERSION;
+		if (fwrite(&hdr, sizeof(hdr), 1, log->stream) == 1)
+			return log;
+		error("%s", path);
+	} else {
+		if (fread(&hdr, sizeof(hdr), 1, log->stream) == 1 &&
+		    memcmp(hdr.magic, IOLOG_MAGIC, sizeof(hdr.magic)) == 0 &&
+		    hdr.version == IOLOG_VERSION)
+			return log;
+		errorx("%s: not a device input log file", path);
+	}
+
+	fclose(log->stream);
+	free(log);
+
+	return NULL;
+}
+
+/**
+ * iolog_record() - log data returned to the guest by an emulated device
+ *
+ * @log:  device input log opened for recording
+ * @exit: number of guest initiated exits preceding the event
+ * @type: IOLOG_* event type
+ * @addr: port number or MMIO guest physical address
+ * @data: data returned to the guest
+ * @size: size of data in bytes
+ *
+ * Return: zero on success, or -1 if an error occurred
+ */
+int iolog_record(struct iolog *log, uint64_t exit, unsigned type,
+		 uint64_t addr, const void *data, size_t size)
+{
+	struct iolog_event ev;
+
+	assert(log != NULL);
+	assert(log->mode == IOLOG_RECORD);
+	assert(data != NULL);
+	assert(size <= MAX_DATA);
+
+	ev.exit = exit;
+	ev.addr = addr;
+	ev.type = type;
+	ev.size = size;
+
+	if (fwrite(&ev, sizeof(ev), 1, log->stream) != 1 ||
+	    fwrite(data, size, 1, log->stream) != 1) {
+		error("%s", log->path);
+		return -1;
+	}
+
+	log->num_events++;
+
+	return 0;
+}
+
+/**
+ * iolog_replay() - feed the next logged input to the guest
+ *
+ * The guest has to request exactly the same input at exactly the same exit
+ * as during recording, otherwise its execution diverged and replay fails.
+ *
+ * @log:  device input log opened for replaying
+ * @exit: number of guest initiated exits preceding the event
+ * @type: IOLOG_* event type
+ * @addr: port number or MMIO guest physical address
+ * @data: where to store data returned to the guest
+ * @size: size of data in bytes
+ *
+ * Return: zero on success, or -1 if replay diverged or an error occurred
+ */
+int iolog_replay(struct iolog *log, uint64_t exit, unsigned type,
+		 uint64_t addr, void *data, size_t size)
+{
+	struct iolog_event ev;
+
+	assert(log != NULL);
+	assert(log->mode == IOLOG_REPLAY);
+	assert(data != NULL);
+
+	if (fread(&ev, sizeof(ev), 1, log->stream) != 1) {
+		if (ferror(log->stream))
+			error("%s", log->path);
+		else
+			errorx("%s: replay diverged at exit %" PRIu64
+			       ", log exhausted", log->path, exit);
+		return -1;
+	}
+
+	if (ev.exit != exit || ev.type != type || ev.addr != addr ||
+	    ev.size != size) {
+		errorx("%s: replay diverged at exit %" PRIu64 ", expected "
+		       "type %u at 0x%" PRIx64 " at exit %" PRIu64,
+		       log->path, exit, ev.type, ev.addr, ev.exit);
+		return -1;
+	}
+
+	if (fread(data, size, 1, log->stream) != 1) {
+		errorx("%s: truncated device input log", log->path);
+		return -1;
+	}
+
+	log->num_events++;
+
+	return 0;
+}
+
+/**
+ * iolog_close() - close a device input log
+ *
+ * @log: device input log
+ *
+ * Return: zero on success, or -1 if the log is incomplete or was not fully
+ *         replayed
+ */
+int iolog_close(struct iolog *log)
+{
+	int ret = 0;
+
+	assert(log != NULL);
+
+	if (log->mode == IOLOG_REPLAY && fgetc(log->stream) != EOF) {
+		errorx("%s: guest finished after %" PRIu64 " inputs, before "
+		       "consuming all of them", log->path, log->num_events);
+		ret = -1;
+	}
+
+	if (fclose(log->stream) != 0) {
+		error("%s", log->path);
+		ret = -1;
+	}
+
+	free(log);
+
+	return ret;
+}
@@ -0,0 +1,38 @@
+#ifndef _IOLOG_H
+#define _IOLOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct iolog;
+
+/**
+ * enum - device input log modes
+ *
+ * @IOLOG_RECORD: log guest inputs into a file
+ * @IOLOG_REPLAY: feed guest inputs from a file
+ */
+enum {
+	IOLOG_RECORD,
+	IOLOG_REPLAY,
+};
+
+/**
+ * enum - guest input event types
+ *
+ * @IOLOG_PORT_IN:   data returned by a port read
+ * @IOLOG_MMIO_READ: data returned by an MMIO read
+ */
+enum {
+	IOLOG_PORT_IN   = 1,
+	IOLOG_MMIO_READ = 2,
+};
+
+struct iolog *iolog_open(const char *, int);
+int iolog_record(struct iolog *, uint64_t, unsigned, uint64_t,
+		 const void *, size_t);
+int iolog_replay(struct iolog *, uint64_t, unsigned, uint64_t,
+		 void *, size_t);
+int iolog_close(struct iolog *);
+
+#endif /* _IOLOG_H */
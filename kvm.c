@@ -1,52 +1,110 @@
 #include <assert.h>
+#include <errno.h>
 #include <inttypes.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <fcntl.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/user.h>
 #include <unistd.h>
 
 #include <linux/kvm.h>
 
+#include "bulk.h"
 #include "kvm.h"
 #include "log.h"
 
 /**
  * enum
  *
- * @MAX_VCPUS:    maximum number of virtual CPUs
- * @MAX_MEMSLOTS: maximum number of memory slots
+ * @SYNC_REGS:         register sets mirrored in the shared virtual CPU region
+ *
+ * @MIN_CPUID_ENTRIES: initial size of supported CPUID table
+ * @MAX_CPUID_ENTRIES: maximum size of supported CPUID table
+ *
+ * @CPUID_FEATURES:    feature information leaf
+ * @CPUID_TOPOLOGY:    extended topology enumeration leaf
+ * @CPUID_TOPOLOGY_V2: V2 extended topology enumeration leaf
  */
 enum {
-	MAX_VCPUS    = 4,
-	MAX_MEMSLOTS = 8,
+	SYNC_REGS         = KVM_SYNC_X86_REGS | KVM_SYNC_X86_SREGS,
+
+	MIN_CPUID_ENTRIES = 64,
+	MAX_CPUID_ENTRIES = 1024,
+
+	CPUID_FEATURES    = 0x1,
+	CPUID_TOPOLOGY    = 0xb,
+	CPUID_TOPOLOGY_V2 = 0x1f,
 };
 
 /**
  * struct vm - virtual machine structure
  *
+ * @kvm_fd:         KVM subsystem handle
  * @vm_fd:          virtual machine file descriptor
  * @num_vcpus:      number of virtual CPUs
  * @vcpu_mmap_size: size of shared virtual CPU region
+ * @sync_regs:      SYNC_REGS if supported by KVM, or zero otherwise
+ * @adjust_clock:   non-zero if KVM_CAP_ADJUST_CLOCK is supported
+ * @stats_fd:       virtual machine binary statistics file descriptor, or
+ *                  zero if KVM_CAP_BINARY_STATS_FD is not supported
  * @vcpu_fd:        virtual CPU file descriptors
+ * @vcpu_stats_fd:  virtual CPU binary statistics file descriptors
  * @vcpu:           mmaped virtual CPU shared regions
+ * @vcpu_synced:    non-zero if shared region holds current register sets
+ * @vcpu_thread:    thread that last ran a virtual CPU
+ * @vcpu_started:   non-zero if a virtual CPU has been run by a thread
  * @num_mem_slots:  number of attached memory slots
+ * @mem_slot:       attached memory slots
+ * @cpuid:          CPUID table for new virtual CPUs, or NULL if not fetched
  */
 struct vm {
+	int kvm_fd;
 	int vm_fd;
 	unsigned num_vcpus;
 	unsigned vcpu_mmap_size;
+	unsigned sync_regs;
+	int adjust_clock;
+	int stats_fd;
 	int vcpu_fd[MAX_VCPUS];
+	int vcpu_stats_fd[MAX_VCPUS];
 	struct kvm_run *vcpu[MAX_VCPUS];
+	int vcpu_synced[MAX_VCPUS];
+	pthread_t vcpu_thread[MAX_VCPUS];
+	int vcpu_started[MAX_VCPUS];
 	unsigned num_mem_slots;
 	struct kvm_userspace_memory_region mem_slot[MAX_MEMSLOTS];
+	struct kvm_cpuid2 *cpuid;
 };
 
+/*
+ * Shared region of a virtual CPU, which is being run by the current thread
+ */
+static __thread struct kvm_run *running_vcpu;
+
+/**
+ * kick_handler() - force the virtual CPU of the current thread out of guest
+ *
+ * @sig: signal number
+ */
+static void kick_handler(int sig)
+{
+	struct kvm_run *run = running_vcpu;
+
+	(void) sig;
+
+	/* Covers signals delivered right before KVM_RUN is entered */
+	if (run != NULL)
+		run->immediate_exit = 1;
+}
+
 /**
  * kvm_open() - obtain a handle to KVM subsystem
  *
@@ -96,10 +154,20 @@ void kvm_close(int kvm)
  */
 struct vm *vm_create(int kvm)
 {
+	struct sigaction sa;
 	struct vm *vm;
 
 	assert(kvm > 0);
 
+	/* No SA_RESTART, so that KVM_RUN is interrupted by the signal */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = kick_handler;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(VCPU_KICK_SIGNAL, &sa, NULL) != 0) {
+		error("failed to install VCPU kick handler");
+		return NULL;
+	}
+
 	vm = malloc(sizeof(*vm));
 	if (vm == NULL) {
 		error("failed to allocate virtual machine structure");
@@ -107,6 +175,7 @@ struct vm *vm_create(int kvm)
 	}
 
 	memset(vm, 0, sizeof(*vm));
+	vm->kvm_fd = kvm;
 	vm->vcpu_mmap_size = ioctl(kvm, KVM_GET_VCPU_MMAP_SIZE, 0);
 	vm->vm_fd = ioctl(kvm, KVM_CREATE_VM, 0);
 	if (vm->vm_fd < 0) {
@@ -115,6 +184,27 @@ struct vm *vm_create(int kvm)
 		return NULL;
 	}
 
+	/* Exit handlers access registers through kvm_run when possible */
+	if ((ioctl(vm->vm_fd, KVM_CHECK_EXTENSION, KVM_CAP_SYNC_REGS) &
+	     SYNC_REGS) == SYNC_REGS)
+		vm->sync_regs = SYNC_REGS;
+
+	/* Guest clock is carried along with the rest of the guest state */
+	vm->adjust_clock = ioctl(vm->vm_fd, KVM_CHECK_EXTENSION,
+				 KVM_CAP_ADJUST_CLOCK) > 0;
+
+	/* Statistics are optional, virtual CPUs follow the VM lead */
+	if (ioctl(vm->vm_fd, KVM_CHECK_EXTENSION,
+		  KVM_CAP_BINARY_STATS_FD) > 0) {
+		vm->stats_fd = ioctl(vm->vm_fd, KVM_GET_STATS_FD, 0);
+		if (vm->stats_fd < 0) {
+			error("failed to open virtual machine statistics");
+			close(vm->vm_fd);
+			free(vm);
+			return NULL;
+		}
+	}
+
 	return vm;
 }
 
@@ -167,6 +257,28 @@ int vm_attach_memory(struct vm *vm, uintptr_t gpa, size_t size, void *addr)
  * Return: start of host addressable memory region, or NULL on failure
  */
 void *vm_get_memory(struct vm *vm, uintptr_t gpa, size_t size)
+{
+	void *hva;
+
+	hva = vm_probe_memory(vm, gpa, size);
+	if (hva == NULL)
+		errorx("no memory region found for 0x%" PRIxPTR
+		       "..0x%" PRIxPTR, gpa, gpa + size);
+
+	return hva;
+}
+
+/**
+ * vm_probe_memory() - same as vm_get_memory(), but silently fails, so that
+ *                     guest controlled addresses can be checked
+ *
+ * @vm:   virtual machine descriptor
+ * @gpa:  guest physical address
+ * @size: memory region size
+ *
+ * Return: start of host addressable memory region, or NULL on failure
+ */
+void *vm_probe_memory(struct vm *vm, uintptr_t gpa, size_t size)
 {
 	struct kvm_userspace_memory_region *m;
 
@@ -174,16 +286,268 @@ void *vm_get_memory(struct vm *vm, uintptr_t gpa, size_t size)
 
 	for (m = vm->mem_slot; m < vm->mem_slot + vm->num_mem_slots; m++)
 		if (m->guest_phys_addr <= gpa &&
+		    gpa + size >= gpa &&
 		    m->guest_phys_addr + m->memory_size >= gpa + size)
 			return (void *) m->userspace_addr +
 			    (gpa - m->guest_phys_addr);
 
-	errorx("no memory region found for 0x%" PRIxPTR "..0x%" PRIxPTR,
-	       gpa, gpa + size);
-
 	return NULL;
 }
 
+/**
+ * vm_guest_iov() - split guest physical memory range into host addressable
+ *                  pieces, one per memory region it crosses
+ *
+ * Pieces of adjacent memory regions that are adjacent in host memory as
+ * well are merged.
+ *
+ * @vm:      virtual machine descriptor
+ * @gpa:     guest physical address
+ * @size:    memory range size
+ * @iov:     where to store host addressable pieces
+ * @max_iov: number of elements of @iov, MAX_MEMSLOTS is always enough
+ *
+ * Return: number of pieces stored, or -1 if part of the range is not
+ *         backed by guest memory or @iov is too short
+ */
+int vm_guest_iov(struct vm *vm, uintptr_t gpa, size_t size,
+		 struct iovec *iov, unsigned max_iov)
+{
+	const struct kvm_userspace_memory_region *m, *end;
+	uintptr_t start = gpa, last = gpa + size;
+	uint8_t *hva;
+	unsigned n = 0;
+	size_t len;
+
+	assert(vm != NULL);
+	assert(iov != NULL || max_iov == 0);
+
+	end = vm->mem_slot + vm->num_mem_slots;
+	while (size > 0) {
+		for (m = vm->mem_slot; m < end; m++)
+			if (m->guest_phys_addr <= gpa &&
+			    gpa - m->guest_phys_addr < m->memory_size)
+				break;
+
+		if (m == end) {
+			errorx("no memory region found for 0x%" PRIxPTR
+			       "..0x%" PRIxPTR, start, last);
+			return -1;
+		}
+
+		len = m->guest_phys_addr + m->memory_size - gpa;
+		if (len > size)
+			len = size;
+		hva = (uint8_t *) (uintptr_t) m->userspace_addr +
+		    (gpa - m->guest_phys_addr);
+
+		if (n > 0 && (uint8_t *) iov[n - 1].iov_base +
+		    iov[n - 1].iov_len == hva) {
+			iov[n - 1].iov_len += len;
+		} else if (n < max_iov) {
+			iov[n].iov_base = hva;
+			iov[n++].iov_len = len;
+		} else {
+			errorx("0x%" PRIxPTR "..0x%" PRIxPTR " spans more than "
+			       "%u pieces", start, last, max_iov);
+			return -1;
+		}
+
+		gpa += len;
+		size -= len;
+	}
+
+	return n;
+}
+
+/**
+ * vm_read_guest() - copy data out of guest physical memory
+ *
+ * @vm:   virtual machine descriptor
+ * @gpa:  guest physical address
+ * @buf:  where to store data
+ * @size: number of bytes
+ *
+ * Return: zero on success, or -1 if an error occurred
+ */
+int vm_read_guest(struct vm *vm, uintptr_t gpa, void *buf, size_t size)
+{
+	struct iovec iov[MAX_MEMSLOTS];
+	uint8_t *dst = buf;
+	int i, n;
+
+	assert(buf != NULL || size == 0);
+
+	n = vm_guest_iov(vm, gpa, size, iov, MAX_MEMSLOTS);
+	for (i = 0; i < n; dst += iov[i++].iov_len)
+		bulk_copy(dst, iov[i].iov_base, iov[i].iov_len);
+
+	return n < 0 ? -1 : 0;
+}
+
+/**
+ * vm_write_guest() - copy data into guest physical memory
+ *
+ * @vm:   virtual machine descriptor
+ * @gpa:  guest physical address
+ * @buf:  data to copy
+ * @size: number of bytes
+ *
+ * Return: zero on success, or -1 if an error occurred
+ */
+int vm_write_guest(struct vm *vm, uintptr_t gpa, const void *buf,
+		   size_t size)
+{
+	struct iovec iov[MAX_MEMSLOTS];
+	const uint8_t *src = buf;
+	int i, n;
+
+	assert(buf != NULL || size == 0);
+
+	n = vm_guest_iov(vm, gpa, size, iov, MAX_MEMSLOTS);
+	for (i = 0; i < n; src += iov[i++].iov_len)
+		bulk_copy(iov[i].iov_base, src, iov[i].iov_len);
+
+	return n < 0 ? -1 : 0;
+}
+
+/**
+ * vm_zero_guest() - fill guest physical memory with zeroes
+ *
+ * @vm:   virtual machine descriptor
+ * @gpa:  guest physical address
+ * @size: number of bytes
+ *
+ * Return: zero on success, or -1 if an error occurred
+ */
+int vm_zero_guest(struct vm *vm, uintptr_t gpa, size_t size)
+{
+	struct iovec iov[MAX_MEMSLOTS];
+	int i, n;
+
+	n = vm_guest_iov(vm, gpa, size, iov, MAX_MEMSLOTS);
+	for (i = 0; i < n; i++)
+		bulk_zero(iov[i].iov_base, iov[i].iov_len);
+
+	return n < 0 ? -1 : 0;
+}
+
+/**
+ * vm_compare_guest() - compare guest physical memory with a buffer
+ *
+ * @vm:   virtual machine descriptor
+ * @gpa:  guest physical address
+ * @buf:  data to compare with, or NULL to check for zeroes
+ * @size: number of bytes
+ *
+ * Return: zero if contents are the same, one if they differ, or -1 if an
+ *         error occurred
+ */
+int vm_compare_guest(struct vm *vm, uintptr_t gpa, const void *buf,
+		     size_t size)
+{
+	struct iovec iov[MAX_MEMSLOTS];
+	const uint8_t *p = buf;
+	int i, n;
+
+	n = vm_guest_iov(vm, gpa, size, iov, MAX_MEMSLOTS);
+	if (n < 0)
+		return -1;
+
+	for (i = 0; i < n; i++) {
+		if (buf == NULL ?
+		    !bulk_is_zero(iov[i].iov_base, iov[i].iov_len) :
+		    memcmp(iov[i].iov_base, p, iov[i].iov_len) != 0)
+			return 1;
+		if (buf != NULL)
+			p += iov[i].iov_len;
+	}
+
+	return 0;
+}
+
+/**
+ * vm_set_dirty_log() - enable or disable dirty page logging on a memory region
+ *
+ * @vm:     virtual machine descriptor
+ * @slot:   ID of the memory region
+ * @enable: non-zero to enable logging, or zero to disable it
+ *
+ * Return: zero on success, or -1 if an error occurred
+ */
+int vm_set_dirty_log(struct vm *vm, unsigned slot, int enable)
+{
+	struct kvm_userspace_memory_region *mem;
+	uint32_t flags;
+
+	assert(vm != NULL);
+	assert(slot < vm->num_mem_slots);
+
+	mem = &vm->mem_slot[slot];
+	flags = mem->flags;
+	if (enable)
+		mem->flags |= KVM_MEM_LOG_DIRTY_PAGES;
+	else
+		mem->flags &= ~KVM_MEM_LOG_DIRTY_PAGES;
+
+	if (ioctl(vm->vm_fd, KVM_SET_USER_MEMORY_REGION, mem) != 0) {
+		error("failed to set dirty logging on memory region #%u", slot);
+		mem->flags = flags;
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * vm_get_dirty_log() - fetch and reset dirty page bitmap of a memory region
+ *
+ * @vm:     virtual machine descriptor
+ * @slot:   ID of the memory region with dirty page logging enabled
+ * @bitmap: where to store one bit per page of the region, rounded up to
+ *          a multiple of 64 bits
+ *
+ * Return: zero on success, or -1 if an error occurred
+ */
+int vm_get_dirty_log(struct vm *vm, unsigned slot, uint64_t *bitmap)
+{
+	struct kvm_dirty_log log;
+
+	assert(vm != NULL);
+	assert(slot < vm->num_mem_slots);
+	assert(bitmap != NULL);
+
+	memset(&log, 0, sizeof(log));
+	log.slot = slot;
+	log.dirty_bitmap = bitmap;
+
+	if (ioctl(vm->vm_fd, KVM_GET_DIRTY_LOG, &log) != 0) {
+		error("failed to get dirty log of memory region #%u", slot);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * vm_get_memslot() - get an attached memory region of a virtual machine
+ *
+ * @vm:   virtual machine descriptor
+ * @slot: ID of the memory region
+ *
+ * Return: memory region, or NULL if there is no such region
+ */
+const struct kvm_userspace_memory_region *vm_get_memslot(struct vm *vm,
+							 unsigned slot)
+{
+	assert(vm != NULL);
+
+	if (slot >= vm->num_mem_slots)
+		return NULL;
+
+	return &vm->mem_slot[slot];
+}
+
 /**
  * vm_destroy() - destroy a virtual machine
  *
@@ -196,18 +560,310 @@ void vm_destroy(struct vm *vm)
 	assert(vm != NULL);
 
 	for (i = 0; i < vm->num_vcpus; i++) {
+		if (vm->vcpu_stats_fd[i] > 0)
+			close(vm->vcpu_stats_fd[i]);
 		if (vm->vcpu_fd[i] > 0)
 			close(vm->vcpu_fd[i]);
 		if (vm->vcpu[i] != NULL)
 			munmap(vm->vcpu[i], vm->vcpu_mmap_size);
 	}
 
+	if (vm->stats_fd > 0)
+		close(vm->stats_fd);
+
 	if (vm->vm_fd > 0)
 		close(vm->vm_fd);
 
+	free(vm->cpuid);
 	free(vm);
 }
 
+/**
+ * get_supported_cpuid() - fetch CPUID table supported by KVM, unless it has
+ *                         already been fetched
+ *
+ * @vm: virtual machine descriptor
+ *
+ * Return: zero on success, or -1 if an error occurred
+ */
+static int get_supported_cpuid(struct vm *vm)
+{
+	struct kvm_cpuid2 *cpuid;
+	unsigned nent;
+	int err;
+
+	if (vm->cpuid != NULL)
+		return 0;
+
+	for (nent = MIN_CPUID_ENTRIES; nent <= MAX_CPUID_ENTRIES; nent *= 2) {
+		cpuid = calloc(1, sizeof(*cpuid) +
+			       nent * sizeof(cpuid->entries[0]));
+		if (cpuid == NULL) {
+			error("failed to allocate CPUID table");
+			return -1;
+		}
+
+		cpuid->nent = nent;
+		if (ioctl(vm->kvm_fd, KVM_GET_SUPPORTED_CPUID, cpuid) == 0) {
+			vm->cpuid = cpuid;
+			return 0;
+		}
+
+		/* KVM reports E2BIG until the table is large enough */
+		err = errno;
+		free(cpuid);
+		errno = err;
+		if (err != E2BIG)
+			break;
+	}
+
+	error("failed to get supported CPUID");
+
+	return -1;
+}
+
+/**
+ * find_cpuid() - find a CPUID table entry
+ *
+ * @cpuid:    CPUID table
+ * @function: CPUID leaf (EAX input)
+ * @index:    CPUID subleaf (ECX input), ignored by leaves without subleaves
+ *
+ * Return: CPUID table entry, or NULL if there is no such entry
+ */
+static struct kvm_cpuid_entry2 *find_cpuid(struct kvm_cpuid2 *cpuid,
+					   uint32_t function, uint32_t index)
+{
+	struct kvm_cpuid_entry2 *e;
+
+	for (e = cpuid->entries; e < cpuid->entries + cpuid->nent; e++)
+		if (e->function == function &&
+		    ((e->flags & KVM_CPUID_FLAG_SIGNIFCANT_INDEX) == 0 ||
+		     e->index == index))
+			return e;
+
+	return NULL;
+}
+
+/**
+ * vm_mask_cpuid() - hide CPUID bits from virtual CPUs created afterwards
+ *
+ * Virtual CPUs are given the CPUID table supported by KVM, which mostly
+ * passes host features through; this clears bits of one of its registers.
+ *
+ * @vm:       virtual machine descriptor
+ * @function: CPUID leaf (EAX input)
+ * @index:    CPUID subleaf (ECX input)
+ * @reg:      CPUID_* output register
+ * @mask:     bits to keep
+ *
+ * Return: zero on success, or -1 if an error occurred
+ */
+int vm_mask_cpuid(struct vm *vm, uint32_t function, uint32_t index,
+		  unsigned reg, uint32_t mask)
+{
+	struct kvm_cpuid_entry2 *e;
+
+	assert(vm != NULL);
+	assert(reg <= CPUID_EDX);
+
+	if (get_supported_cpuid(vm) != 0)
+		return -1;
+
+	e = find_cpuid(vm->cpuid, function, index);
+	if (e == NULL) {
+		errorx("CPUID leaf 0x%" PRIx32 ".%" PRIu32 " is not supported",
+		       function, index);
+		return -1;
+	}
+
+	switch (reg) {
+	case CPUID_EAX:
+		e->eax &= mask;
+		break;
+	case CPUID_EBX:
+		e->ebx &= mask;
+		break;
+	case CPUID_ECX:
+		e->ecx &= mask;
+		break;
+	case CPUID_EDX:
+		e->edx &= mask;
+		break;
+	}
+
+	return 0;
+}
+
+/**
+ * vm_get_cpuid() - get a CPUID table entry given to virtual CPUs
+ *
+ * @vm:       virtual machine descriptor
+ * @function: CPUID leaf (EAX input)
+ * @index:    CPUID subleaf (ECX input)
+ *
+ * Return: CPUID table entry, or NULL if there is no such entry
+ */
+const struct kvm_cpuid_entry2 *vm_get_cpuid(struct vm *vm, uint32_t function,
+					    uint32_t index)
+{
+	assert(vm != NULL);
+
+	if (get_supported_cpuid(vm) != 0)
+		return NULL;
+
+	return find_cpuid(vm->cpuid, function, index);
+}
+
+/**
+ * vm_get_clock() - read the clock guests see through kvmclock
+ *
+ * @vm: virtual machine descriptor
+ * @ns: where to store guest clock value in nanoseconds
+ *
+ * Return: zero on success, or -1 if an error occurred
+ */
+int vm_get_clock(struct vm *vm, uint64_t *ns)
+{
+	struct kvm_clock_data clock;
+
+	assert(vm != NULL);
+	assert(ns != NULL);
+
+	if (!vm->adjust_clock) {
+		errorx("guest clock adjustment is not supported");
+		return -1;
+	}
+
+	memset(&clock, 0, sizeof(clock));
+	if (ioctl(vm->vm_fd, KVM_GET_CLOCK, &clock) != 0) {
+		error("failed to get guest clock");
+		return -1;
+	}
+
+	*ns = clock.clock;
+
+	return 0;
+}
+
+/**
+ * vm_set_clock() - set the clock guests see through kvmclock
+ *
+ * @vm: virtual machine descriptor
+ * @ns: guest clock value in nanoseconds
+ *
+ * Return: zero on success, or -1 if an error occurred
+ */
+int vm_set_clock(struct vm *vm, uint64_t ns)
+{
+	struct kvm_clock_data clock;
+
+	assert(vm != NULL);
+
+	if (!vm->adjust_clock) {
+		errorx("guest clock adjustment is not supported");
+		return -1;
+	}
+
+	memset(&clock, 0, sizeof(clock));
+	clock.clock = ns;
+	if (ioctl(vm->vm_fd, KVM_SET_CLOCK, &clock) != 0) {
+		error("failed to set guest clock");
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * vm_get_stats_fd() - get binary statistics file descriptor of a virtual
+ *                     machine
+ *
+ * @vm: virtual machine descriptor
+ *
+ * Return: file descriptor, or -1 if KVM does not provide statistics
+ */
+int vm_get_stats_fd(struct vm *vm)
+{
+	assert(vm != NULL);
+
+	return vm->stats_fd > 0 ? vm->stats_fd : -1;
+}
+
+/**
+ * vcpu_get_stats_fd() - get binary statistics file descriptor of a virtual
+ *                       CPU
+ *
+ * @vm:   virtual machine descriptor
+ * @vcpu: virtual CPU identifier
+ *
+ * Return: file descriptor, or -1 if KVM does not provide statistics
+ */
+int vcpu_get_stats_fd(struct vm *vm, unsigned vcpu)
+{
+	assert(vm != NULL);
+	assert(vm->num_vcpus > vcpu);
+
+	return vm->vcpu_stats_fd[vcpu] > 0 ? vm->vcpu_stats_fd[vcpu] : -1;
+}
+
+/**
+ * vm_get_num_vcpus() - get number of virtual CPUs of a virtual machine
+ *
+ * @vm: virtual machine descriptor
+ *
+ * Return: number of created virtual CPUs
+ */
+unsigned vm_get_num_vcpus(struct vm *vm)
+{
+	assert(vm != NULL);
+
+	return vm->num_vcpus;
+}
+
+/**
+ * set_vcpu_cpuid() - configure CPUID of a new virtual CPU
+ *
+ * @vm:   virtual machine descriptor
+ * @vcpu: virtual CPU identifier
+ *
+ * Return: zero on success, or -1 if an error occurred
+ */
+static int set_vcpu_cpuid(struct vm *vm, unsigned vcpu)
+{
+	struct kvm_cpuid_entry2 *e;
+	struct kvm_cpuid2 *cpuid;
+	size_t size;
+	int ret;
+
+	if (get_supported_cpuid(vm) != 0)
+		return -1;
+
+	size = sizeof(*cpuid) + vm->cpuid->nent * sizeof(cpuid->entries[0]);
+	cpuid = malloc(size);
+	if (cpuid == NULL) {
+		error("failed to allocate VCPU #%u CPUID table", vcpu);
+		return -1;
+	}
+
+	/* Initial APIC IDs follow virtual CPU IDs */
+	memcpy(cpuid, vm->cpuid, size);
+	for (e = cpuid->entries; e < cpuid->entries + cpuid->nent; e++)
+		if (e->function == CPUID_FEATURES)
+			e->ebx = (e->ebx & 0x00ffffff) | (vcpu << 24);
+		else if (e->function == CPUID_TOPOLOGY ||
+			 e->function == CPUID_TOPOLOGY_V2)
+			e->edx = vcpu;
+
+	ret = ioctl(vm->vcpu_fd[vcpu], KVM_SET_CPUID2, cpuid);
+	if (ret != 0)
+		error("failed to set VCPU #%u CPUID", vcpu);
+
+	free(cpuid);
+
+	return ret;
+}
+
 /**
  * vcpu_create() - create a new virtual CPU for a virtual machine
  *
@@ -234,21 +890,48 @@ int vcpu_create(struct vm *vm)
 		return -1;
 	}
 
+	/* Shared mapping, as KVM reads fields written by exit handlers */
 	vm->vcpu[i] = mmap(0, vm->vcpu_mmap_size, PROT_READ | PROT_WRITE,
-			   MAP_PRIVATE, vm->vcpu_fd[i], 0);
-	if (vm->vcpu[i] == NULL) {
+			   MAP_SHARED, vm->vcpu_fd[i], 0);
+	if (vm->vcpu[i] == MAP_FAILED) {
 		error("failed to map VCPU #%u", i);
-		close(vm->vcpu_fd[i]);
-		vm->vcpu_fd[i] = 0;
-		return -1;
+		vm->vcpu[i] = NULL;
+		goto err;
 	}
 
+	if (set_vcpu_cpuid(vm, i) != 0)
+		goto err;
+
+	if (vm->stats_fd > 0) {
+		vm->vcpu_stats_fd[i] = ioctl(vm->vcpu_fd[i], KVM_GET_STATS_FD,
+					     0);
+		if (vm->vcpu_stats_fd[i] < 0) {
+			error("failed to open VCPU #%u statistics", i);
+			vm->vcpu_stats_fd[i] = 0;
+			goto err;
+		}
+	}
+
+	vm->vcpu[i]->kvm_valid_regs = vm->sync_regs;
+
 	return vm->num_vcpus++;
+
+err:
+	if (vm->vcpu[i] != NULL)
+		munmap(vm->vcpu[i], vm->vcpu_mmap_size);
+	close(vm->vcpu_fd[i]);
+	vm->vcpu_fd[i] = 0;
+	vm->vcpu[i] = NULL;
+
+	return -1;
 }
 
 /**
  * vcpu_get_regs() - read general purpose registers from a virtual CPU
  *
+ * Once a virtual CPU has run with KVM_CAP_SYNC_REGS available, registers are
+ * accessed through its shared region and no ioctl is issued.
+ *
  * @vm:   virtual machine descriptor
  * @vcpu: virtual CPU identifier
  * @regs: general purpose registers
@@ -264,6 +947,11 @@ int vcpu_get_regs(struct vm *vm, unsigned vcpu, struct kvm_regs *regs)
 	assert(vm->vcpu_fd[vcpu] > 0);
 	assert(regs != NULL);
 
+	if (vm->vcpu_synced[vcpu]) {
+		*regs = vm->vcpu[vcpu]->s.regs.regs;
+		return 0;
+	}
+
 	ret = ioctl(vm->vcpu_fd[vcpu], KVM_GET_REGS, regs);
 	if (ret != 0)
 		error("failed to get VCPU #%u registers", vcpu);
@@ -289,6 +977,12 @@ int vcpu_set_regs(struct vm *vm, unsigned vcpu, const struct kvm_regs *regs)
 	assert(vm->vcpu_fd[vcpu] > 0);
 	assert(regs != NULL);
 
+	if (vm->vcpu_synced[vcpu]) {
+		vm->vcpu[vcpu]->s.regs.regs = *regs;
+		vm->vcpu[vcpu]->kvm_dirty_regs |= KVM_SYNC_X86_REGS;
+		return 0;
+	}
+
 	ret = ioctl(vm->vcpu_fd[vcpu], KVM_SET_REGS, regs);
 	if (ret != 0)
 		error("failed to set VCPU #%u registers", vcpu);
@@ -314,6 +1008,11 @@ int vcpu_get_sregs(struct vm *vm, unsigned vcpu, struct kvm_sregs *regs)
 	assert(vm->vcpu_fd[vcpu] > 0);
 	assert(regs != NULL);
 
+	if (vm->vcpu_synced[vcpu]) {
+		*regs = vm->vcpu[vcpu]->s.regs.sregs;
+		return 0;
+	}
+
 	ret = ioctl(vm->vcpu_fd[vcpu], KVM_GET_SREGS, regs);
 	if (ret != 0)
 		error("failed to get VCPU #%u special registers", vcpu);
@@ -339,6 +1038,12 @@ int vcpu_set_sregs(struct vm *vm, unsigned vcpu, const struct kvm_sregs *regs)
 	assert(vm->vcpu_fd[vcpu] > 0);
 	assert(regs != NULL);
 
+	if (vm->vcpu_synced[vcpu]) {
+		vm->vcpu[vcpu]->s.regs.sregs = *regs;
+		vm->vcpu[vcpu]->kvm_dirty_regs |= KVM_SYNC_X86_SREGS;
+		return 0;
+	}
+
 	ret = ioctl(vm->vcpu_fd[vcpu], KVM_SET_SREGS, regs);
 	if (ret != 0)
 		error("failed to set VCPU #%u special registers", vcpu);
@@ -346,6 +1051,182 @@ int vcpu_set_sregs(struct vm *vm, unsigned vcpu, const struct kvm_sregs *regs)
 	return ret;
 }
 
+/**
+ * vcpu_get_xsave() - read extended processor state from a virtual CPU
+ *
+ * @vm:    virtual machine descriptor
+ * @vcpu:  virtual CPU identifier
+ * @xsave: XSAVE area
+ *
+ * Return: zero on success, or -1 if an error occured
+ */
+int vcpu_get_xsave(struct vm *vm, unsigned vcpu, struct kvm_xsave *xsave)
+{
+	int ret;
+
+	assert(vm != NULL);
+	assert(vm->num_vcpus > vcpu);
+	assert(vm->vcpu_fd[vcpu] > 0);
+	assert(xsave != NULL);
+
+	ret = ioctl(vm->vcpu_fd[vcpu], KVM_GET_XSAVE, xsave);
+	if (ret != 0)
+		error("failed to get VCPU #%u XSAVE area", vcpu);
+
+	return ret;
+}
+
+/**
+ * vcpu_set_xsave() - write extended processor state into a virtual CPU
+ *
+ * @vm:    virtual machine descriptor
+ * @vcpu:  virtual CPU identifier
+ * @xsave: XSAVE area
+ *
+ * Return: zero on success, or -1 if an error occured
+ */
+int vcpu_set_xsave(struct vm *vm, unsigned vcpu, const struct kvm_xsave *xsave)
+{
+	int ret;
+
+	assert(vm != NULL);
+	assert(vm->num_vcpus > vcpu);
+	assert(vm->vcpu_fd[vcpu] > 0);
+	assert(xsave != NULL);
+
+	ret = ioctl(vm->vcpu_fd[vcpu], KVM_SET_XSAVE, xsave);
+	if (ret != 0)
+		error("failed to set VCPU #%u XSAVE area", vcpu);
+
+	return ret;
+}
+
+/**
+ * vcpu_get_xcrs() - read extended control registers from a virtual CPU
+ *
+ * @vm:   virtual machine descriptor
+ * @vcpu: virtual CPU identifier
+ * @xcrs: extended control registers
+ *
+ * Return: zero on success, or -1 if an error occured
+ */
+int vcpu_get_xcrs(struct vm *vm, unsigned vcpu, struct kvm_xcrs *xcrs)
+{
+	int ret;
+
+	assert(vm != NULL);
+	assert(vm->num_vcpus > vcpu);
+	assert(vm->vcpu_fd[vcpu] > 0);
+	assert(xcrs != NULL);
+
+	ret = ioctl(vm->vcpu_fd[vcpu], KVM_GET_XCRS, xcrs);
+	if (ret != 0)
+		error("failed to get VCPU #%u extended control registers",
+		      vcpu);
+
+	return ret;
+}
+
+/**
+ * vcpu_set_xcrs() - write extended control registers into a virtual CPU
+ *
+ * @vm:   virtual machine descriptor
+ * @vcpu: virtual CPU identifier
+ * @xcrs: extended control registers
+ *
+ * Return: zero on success, or -1 if an error occured
+ */
+int vcpu_set_xcrs(struct vm *vm, unsigned vcpu, const struct kvm_xcrs *xcrs)
+{
+	int ret;
+
+	assert(vm != NULL);
+	assert(vm->num_vcpus > vcpu);
+	assert(vm->vcpu_fd[vcpu] > 0);
+	assert(xcrs != NULL);
+
+	ret = ioctl(vm->vcpu_fd[vcpu], KVM_SET_XCRS, xcrs);
+	if (ret != 0)
+		error("failed to set VCPU #%u extended control registers",
+		      vcpu);
+
+	return ret;
+}
+
+/**
+ * vcpu_get_msr() - read a model specific register from a virtual CPU
+ *
+ * @vm:    virtual machine descriptor
+ * @vcpu:  virtual CPU identifier
+ * @index: MSR index
+ * @value: where to store MSR value
+ *
+ * Return: zero on success, or -1 if an error occured
+ */
+int vcpu_get_msr(struct vm *vm, unsigned vcpu, uint32_t index,
+		 uint64_t *value)
+{
+	struct {
+		struct kvm_msrs hdr;
+		struct kvm_msr_entry entry;
+	} msrs;
+
+	assert(vm != NULL);
+	assert(vm->num_vcpus > vcpu);
+	assert(vm->vcpu_fd[vcpu] > 0);
+	assert(value != NULL);
+
+	memset(&msrs, 0, sizeof(msrs));
+	msrs.hdr.nmsrs = 1;
+	msrs.entry.index = index;
+
+	/* Number of MSRs read is returned */
+	if (ioctl(vm->vcpu_fd[vcpu], KVM_GET_MSRS, &msrs) != 1) {
+		error("failed to get VCPU #%u MSR 0x%" PRIx32, vcpu, index);
+		return -1;
+	}
+
+	*value = msrs.entry.data;
+
+	return 0;
+}
+
+/**
+ * vcpu_set_msr() - write a model specific register into a virtual CPU
+ *
+ * @vm:    virtual machine descriptor
+ * @vcpu:  virtual CPU identifier
+ * @index: MSR index
+ * @value: MSR value
+ *
+ * Return: zero on success, or -1 if an error occured
+ */
+int vcpu_set_msr(struct vm *vm, unsigned vcpu, uint32_t index,
+		 uint64_t value)
+{
+	struct {
+		struct kvm_msrs hdr;
+		struct kvm_msr_entry entry;
+	} msrs;
+
+	assert(vm != NULL);
+	assert(vm->num_vcpus > vcpu);
+	assert(vm->vcpu_fd[vcpu] > 0);
+
+	memset(&msrs, 0, sizeof(msrs));
+	msrs.hdr.nmsrs = 1;
+	msrs.entry.index = index;
+	msrs.entry.data = value;
+
+	/* Number of MSRs written is returned */
+	if (ioctl(vm->vcpu_fd[vcpu], KVM_SET_MSRS, &msrs) != 1) {
+		error("failed to set VCPU #%u MSR 0x%" PRIx32, vcpu, index);
+		return -1;
+	}
+
+	return 0;
+}
+
 /**
  * vcpu_get() - get virtual CPU parameter block
  *
@@ -366,6 +1247,9 @@ struct kvm_run *vcpu_get(struct vm *vm, unsigned vcpu)
 /**
  * vcpu_run() - run a virtual CPU of a virtual machine
  *
+ * A virtual CPU interrupted by VCPU_KICK_SIGNAL returns successfully with
+ * KVM_EXIT_INTR exit reason.
+ *
  * @vm:   virtual machine descriptor
  * @vcpu: virtua CPU identifier
  *
@@ -373,15 +1257,54 @@ struct kvm_run *vcpu_get(struct vm *vm, unsigned vcpu)
  */
 int vcpu_run(struct vm *vm, unsigned vcpu)
 {
+	struct kvm_run *run;
 	int ret;
 
 	assert(vm != NULL);
 	assert(vm->num_vcpus > vcpu);
 	assert(vm->vcpu_fd[vcpu] > 0);
 
+	if (!vm->vcpu_started[vcpu]) {
+		vm->vcpu_thread[vcpu] = pthread_self();
+		__atomic_store_n(&vm->vcpu_started[vcpu], 1, __ATOMIC_RELEASE);
+	}
+
+	run = vm->vcpu[vcpu];
+	running_vcpu = run;
 	ret = ioctl(vm->vcpu_fd[vcpu], KVM_RUN, 0);
+	running_vcpu = NULL;
+
+	if (ret != 0 && errno == EINTR) {
+		run->immediate_exit = 0;
+		run->exit_reason = KVM_EXIT_INTR;
+		ret = 0;
+	}
+
 	if (ret != 0)
 		error("failed to run VCPU #%u", vcpu);
+	else
+		vm->vcpu_synced[vcpu] = vm->sync_regs != 0;
 
 	return ret;
 }
+
+/**
+ * vcpu_kick() - make a virtual CPU exit with KVM_EXIT_INTR as soon as
+ *               possible
+ *
+ * May be called from any thread. A virtual CPU that has not been run yet
+ * exits right on its first entry.
+ *
+ * @vm:   virtual machine descriptor
+ * @vcpu: virtual CPU identifier
+ */
+void vcpu_kick(struct vm *vm, unsigned vcpu)
+{
+	assert(vm != NULL);
+	assert(vm->num_vcpus > vcpu);
+
+	__atomic_store_n(&vm->vcpu[vcpu]->immediate_exit, 1, __ATOMIC_RELEASE);
+
+	if (__atomic_load_n(&vm->vcpu_started[vcpu], __ATOMIC_ACQUIRE))
+		pthread_kill(vm->vcpu_thread[vcpu], VCPU_KICK_SIGNAL);
+}
@@ -1,13 +1,51 @@
 #ifndef _KVM_H
 #define _KVM_H
 
+#include <signal.h>
 #include <stddef.h>
 #include <stdint.h>
 
+/**
+ * VCPU_KICK_SIGNAL - signal that makes a running virtual CPU exit with
+ *                    KVM_EXIT_INTR when delivered to its thread
+ */
+#define VCPU_KICK_SIGNAL SIGUSR1
+
+/**
+ * enum
+ *
+ * @MAX_VCPUS:    maximum number of virtual CPUs
+ * @MAX_MEMSLOTS: maximum number of memory slots
+ */
+enum {
+	MAX_VCPUS    = 4,
+	MAX_MEMSLOTS = 8,
+};
+
+/**
+ * enum - CPUID output registers
+ *
+ * @CPUID_EAX: EAX register
+ * @CPUID_EBX: EBX register
+ * @CPUID_ECX: ECX register
+ * @CPUID_EDX: EDX register
+ */
+enum {
+	CPUID_EAX,
+	CPUID_EBX,
+	CPUID_ECX,
+	CPUID_EDX,
+};
+
 struct vm;
 struct kvm_run;
 struct kvm_regs;
 struct kvm_sregs;
+struct kvm_userspace_memory_region;
+struct kvm_cpuid_entry2;
+struct kvm_xsave;
+struct kvm_xcrs;
+struct iovec;
 
 int kvm_open(const char *);
 void kvm_close(int);
@@ -15,6 +53,22 @@ void kvm_close(int);
 struct vm *vm_create(int);
 int vm_attach_memory(struct vm *, uintptr_t, size_t, void *);
 void *vm_get_memory(struct vm *, uintptr_t, size_t);
+void *vm_probe_memory(struct vm *, uintptr_t, size_t);
+int vm_guest_iov(struct vm *, uintptr_t, size_t, struct iovec *, unsigned);
+int vm_read_guest(struct vm *, uintptr_t, void *, size_t);
+int vm_write_guest(struct vm *, uintptr_t, const void *, size_t);
+int vm_zero_guest(struct vm *, uintptr_t, size_t);
+int vm_compare_guest(struct vm *, uintptr_t, const void *, size_t);
+int vm_set_dirty_log(struct vm *, unsigned, int);
+int vm_get_dirty_log(struct vm *, unsigned, uint64_t *);
+const struct kvm_userspace_memory_region *vm_get_memslot(struct vm *,
+							 unsigned);
+int vm_mask_cpuid(struct vm *, uint32_t, uint32_t, unsigned, uint32_t);
+const struct kvm_cpuid_entry2 *vm_get_cpuid(struct vm *, uint32_t, uint32_t);
+int vm_get_clock(struct vm *, uint64_t *);
+int vm_set_clock(struct vm *, uint64_t);
+int vm_get_stats_fd(struct vm *);
+unsigned vm_get_num_vcpus(struct vm *);
 void vm_destroy(struct vm *);
 
 int vcpu_create(struct vm *);
@@ -22,7 +76,15 @@ int vcpu_get_regs(struct vm *, unsigned, struct kvm_regs *);
 int vcpu_set_regs(struct vm *, unsigned, const struct kvm_regs *);
 int vcpu_get_sregs(struct vm *, unsigned, struct kvm_sregs *);
 int vcpu_set_sregs(struct vm *, unsigned, const struct kvm_sregs *);
+int vcpu_get_xsave(struct vm *, unsigned, struct kvm_xsave *);
+int vcpu_set_xsave(struct vm *, unsigned, const struct kvm_xsave *);
+int vcpu_get_xcrs(struct vm *, unsigned, struct kvm_xcrs *);
+int vcpu_set_xcrs(struct vm *, unsigned, const struct kvm_xcrs *);
+int vcpu_get_msr(struct vm *, unsigned, uint32_t, uint64_t *);
+int vcpu_set_msr(struct vm *, unsigned, uint32_t, uint64_t);
+int vcpu_get_stats_fd(struct vm *, unsigned);
 struct kvm_run *vcpu_get(struct vm *, unsigned);
 int vcpu_run(struct vm *, unsigned);
+void vcpu_kick(struct vm *, unsigned);
 
 #endif /* _KVM_H */
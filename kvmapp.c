@@ -1,32 +1,260 @@
+#define _GNU_SOURCE
+
 #include <assert.h>
+#include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
+#include <poll.h>
+#include <sched.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/user.h>
 #include <unistd.h>
 
 #include <linux/kvm.h>
+#include <linux/mempolicy.h>
 
+#include "iolog.h"
 #include "kvm.h"
 #include "loader/binary.h"
 #include "log.h"
+#include "migrate.h"
+#include "prealloc.h"
+#include "profile.h"
+#include "reclaim.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "symbol.h"
+#include "trace.h"
 #include "vcpu.h"
 
-#define DEFAULT_KVM_PATH   "/dev/kvm" /* default path to KVM device file */
-#define DEFAULT_IMAGE_PATH NULL       /* default guest image file path   */
-#define DEFAULT_NUM_BYTES  0x100000   /* default guest memory size       */
+#define DEFAULT_KVM_PATH     "/dev/kvm" /* default path to KVM device file */
+#define DEFAULT_IMAGE_PATH   NULL       /* default guest image file path   */
+#define DEFAULT_NUM_BYTES    0x100000   /* default guest memory size       */
+#define DEFAULT_PROFILE_PATH NULL       /* default folded stacks file path */
+#define DEFAULT_PROFILE_HZ   997        /* default profiler sampling rate  */
+#define DEFAULT_SYMBOLS_PATH NULL       /* default guest symbols file path */
+#define DEFAULT_TRACE_PATH   NULL       /* default exit trace file path    */
+#define DEFAULT_RECORD_PATH  NULL       /* default input log to record     */
+#define DEFAULT_REPLAY_PATH  NULL       /* default input log to replay     */
+#define DEFAULT_PREALLOC     0          /* default memory populate threads */
+#define DEFAULT_MIGRATE_PATH NULL       /* default migration target socket */
+#define DEFAULT_INCOMING     NULL       /* default migration source socket */
+#define DEFAULT_RECLAIM_MS   0          /* default idle memory period      */
+#define DEFAULT_PAGEOUT      0          /* default idle memory advice      */
+#define DEFAULT_BENCH_RUNS   0          /* default startup bench runs      */
+#define DEFAULT_PAGES        PAGES_HOST /* default guest memory page size  */
+#define DEFAULT_CPU          -1         /* default VCPU thread host CPU    */
+#define DEFAULT_NUMA_NODE    -1         /* default guest memory NUMA node  */
+#define DEFAULT_STATS_PATH   NULL       /* default metrics file path       */
+#define DEFAULT_STATS_MS     1000       /* default metrics export interval */
+#define DEFAULT_REPEAT       1          /* default number of guest runs    */
+
+#define MAX_CPUID_MASKS      16         /* maximum number of CPUID masks   */
+
+/**
+ * enum - long only command line options
+ *
+ * @OPT_PROFILE_HZ: profiler sampling frequency
+ * @OPT_RECORD:     device input log to record
+ * @OPT_REPLAY:     device input log to replay
+ * @OPT_PREALLOC:   populate guest memory before start
+ * @OPT_MIGRATE_TO: migrate the guest to another process
+ * @OPT_INCOMING:   receive the guest from another process
+ * @OPT_CPUID_MASK: hide CPUID bits from the guest
+ * @OPT_RECLAIM:    reclaim guest memory idle for a period
+ * @OPT_PAGEOUT:    page idle guest memory out right away
+ * @OPT_BENCH:      time startup phases over a number of iterations
+ * @OPT_PAGES:      guest memory page size
+ * @OPT_CPU:        host CPU to pin the VCPU thread to
+ * @OPT_NUMA_NODE:  NUMA node to bind guest memory to
+ * @OPT_STATS:      export KVM statistics to a metrics file
+ * @OPT_STATS_MS:   metrics export interval
+ * @OPT_REPEAT:     run the guest a number of times in the same VM
+ */
+enum {
+	OPT_PROFILE_HZ = 256,
+	OPT_RECORD,
+	OPT_REPLAY,
+	OPT_PREALLOC,
+	OPT_MIGRATE_TO,
+	OPT_INCOMING,
+	OPT_CPUID_MASK,
+	OPT_RECLAIM,
+	OPT_PAGEOUT,
+	OPT_BENCH,
+	OPT_PAGES,
+	OPT_CPU,
+	OPT_NUMA_NODE,
+	OPT_STATS,
+	OPT_STATS_MS,
+	OPT_REPEAT,
+};
+
+/**
+ * enum - startup phases, in order
+ *
+ * @PHASE_START:         process is ready to create a virtual machine
+ * @PHASE_KVM_OPEN:      KVM subsystem is opened
+ * @PHASE_MMAP:          guest memory is mapped
+ * @PHASE_VM_CREATE:     virtual machine is created
+ * @PHASE_VCPU_CREATE:   bootstrap virtual CPU is created
+ * @PHASE_ATTACH_MEMORY: guest memory is attached
+ * @PHASE_PREALLOC:      guest memory is populated, if requested
+ * @PHASE_BINARY_LOAD:   guest image is loaded
+ * @PHASE_FIRST_RUN:     first guest exit is taken
+ * @PHASE_TEARDOWN:      virtual machine is destroyed
+ * @NUM_PHASES:          number of phases
+ */
+enum {
+	PHASE_START,
+	PHASE_KVM_OPEN,
+	PHASE_MMAP,
+	PHASE_VM_CREATE,
+	PHASE_VCPU_CREATE,
+	PHASE_ATTACH_MEMORY,
+	PHASE_PREALLOC,
+	PHASE_BINARY_LOAD,
+	PHASE_FIRST_RUN,
+	PHASE_TEARDOWN,
+	NUM_PHASES,
+};
+
+/**
+ * enum - guest memory page size policies
+ *
+ * @PAGES_HOST:    leave transparent huge pages to the host defaults
+ * @PAGES_SMALL:   keep guest memory out of transparent huge pages
+ * @PAGES_THP:     ask for transparent huge pages
+ * @PAGES_HUGETLB: back guest memory with reserved huge pages
+ * @HUGETLB_SIZE:  guest memory size granularity with reserved huge pages
+ */
+enum {
+	PAGES_HOST,
+	PAGES_SMALL,
+	PAGES_THP,
+	PAGES_HUGETLB,
+	HUGETLB_SIZE = 2 << 20,
+};
+
+/**
+ * enum - serial console registers and bits
+ *
+ * @UART_DATA:      transmit and receive buffer register port
+ * @UART_LSR:       line status register port
+ * @UART_LSR_DR:    receive buffer holds data
+ * @UART_LSR_THRE:  transmit buffer is empty
+ * @UART_LSR_TEMT:  transmitter is idle
+ */
+enum {
+	UART_DATA     = 0x3f8,
+	UART_LSR      = 0x3fd,
+	UART_LSR_DR   = 1 << 0,
+	UART_LSR_THRE = 1 << 5,
+	UART_LSR_TEMT = 1 << 6,
+};
+
+/**
+ * struct cpuid_mask - CPUID bits to keep in one register of a CPUID leaf
+ *
+ * @function: CPUID leaf (EAX input)
+ * @index:    CPUID subleaf (ECX input)
+ * @reg:      CPUID_* output register
+ * @mask:     bits to keep
+ */
+struct cpuid_mask {
+	uint32_t function;
+	uint32_t index;
+	unsigned reg;
+	uint32_t mask;
+};
 
 /**
  * struct config - parsed command line arguments
  *
- * @kvm_path:   path to KVM subsystem device file
- * @image_path: guest image file path
- * @num_bytes:  guest memory size in bytes
+ * @kvm_path:        path to KVM subsystem device file
+ * @image_path:      guest image file path, or NULL if receiving migration
+ * @num_bytes:       guest memory size in bytes
+ * @profile_path:    folded stacks output file path, or NULL if not profiling
+ * @profile_hz:      profiler sampling frequency
+ * @symbols_path:    guest ELF or map file path, or NULL
+ * @trace_path:      exit trace file path, or NULL if not tracing
+ * @record_path:     device input log file path to record, or NULL
+ * @replay_path:     device input log file path to replay, or NULL
+ * @prealloc:        number of threads populating guest memory before start,
+ *                   or zero to fault guest memory in lazily
+ * @migrate_path:    UNIX socket path to migrate the guest to, or NULL
+ * @incoming:        UNIX socket path to receive the guest on, or NULL
+ * @cpuid_mask:      CPUID masks applied to the host supported CPUID
+ * @num_cpuid_masks: number of CPUID masks
+ * @reclaim_ms:      period after which unwritten guest memory is
+ *                   reclaimed in milliseconds, or zero to keep it
+ * @pageout:         non-zero to page idle guest memory out instead of
+ *                   only marking it cold
+ * @bench_runs:      number of startup benchmark iterations, or zero to run
+ *                   the guest
+ * @pages:           PAGES_* guest memory page size policy
+ * @cpu:             host CPU to pin the VCPU thread to, or -1
+ * @numa_node:       NUMA node to bind guest memory to, or -1
+ * @stats_path:      Prometheus metrics file path, or NULL
+ * @stats_ms:        metrics export interval in milliseconds
+ * @repeat:          number of guest runs, the virtual machine being reset
+ *                   to its initial state between them
  */
 struct config {
 	const char *kvm_path;
 	const char *image_path;
 	size_t num_bytes;
+	const char *profile_path;
+	unsigned profile_hz;
+	const char *symbols_path;
+	const char *trace_path;
+	const char *record_path;
+	const char *replay_path;
+	unsigned prealloc;
+	const char *migrate_path;
+	const char *incoming;
+	struct cpuid_mask cpuid_mask[MAX_CPUID_MASKS];
+	unsigned num_cpuid_masks;
+	unsigned reclaim_ms;
+	int pageout;
+	unsigned bench_runs;
+	int pages;
+	int cpu;
+	int numa_node;
+	const char *stats_path;
+	unsigned stats_ms;
+	unsigned repeat;
+};
+
+/**
+ * struct session - virtual machine and facilities attached to its run
+ *
+ * @vm:          virtual machine descriptor
+ * @prof:        guest profiler, or NULL
+ * @trace:       exit trace recorder, or NULL
+ * @record:      device input log being recorded, or NULL
+ * @replay:      device input log being replayed, or NULL
+ * @mig:         outgoing migration, or NULL
+ * @reclaim:     idle guest memory reclaimer, or NULL
+ * @stats:       KVM statistics exporter, or NULL
+ * @num_exits:   number of guest initiated exits handled so far
+ * @console_eof: non-zero once console input reached end of file
+ */
+struct session {
+	struct vm *vm;
+	struct profile *prof;
+	struct trace *trace;
+	struct iolog *record;
+	struct iolog *replay;
+	struct migration *mig;
+	struct reclaim *reclaim;
+	struct stats *stats;
+	uint64_t num_exits;
+	int console_eof;
 };
 
 /**
@@ -39,13 +267,138 @@ static void NORETURN usage(const char *progname, FILE *stream)
 	assert(progname != NULL);
 	assert(stream != NULL);
 
-	fprintf(stream, "Usage: %s [-h] [-k KVM_PATH] [-m MEGABYTES] IMAGE\n",
-		progname);
+	fprintf(stream,
+		"Usage: %s [-h] [-k KVM_PATH] [-m MEGABYTES] [-p FOLDED_PATH]\n"
+		"       [--profile-hz=HZ] [-s SYMBOLS_PATH] [-t TRACE_PATH]\n"
+		"       [--record=LOG_PATH | --replay=LOG_PATH]\n"
+		"       [--prealloc[=THREADS]] [--migrate-to=SOCKET_PATH]\n"
+		"       [--cpuid-mask=LEAF[.SUBLEAF]:REG=[~]MASK]...\n"
+		"       [--reclaim=IDLE_MS [--pageout]] [--bench-startup=N]\n"
+		"       [--pages=4k|thp|hugetlb] [--cpu=CPU] [--numa-node=NODE]\n"
+		"       [--stats=METRICS_PATH [--stats-interval=MS]]\n"
+		"       [--repeat=N] IMAGE | --incoming=SOCKET_PATH\n"
+		"\n"
+		"  -h, --help              print this help and exit\n"
+		"  -k, --kvm=PATH          KVM device file path\n"
+		"  -m, --memory=MEGABYTES  guest memory size\n"
+		"  -p, --profile=PATH      sample guest code, writing folded\n"
+		"                          stacks to PATH and a flat profile\n"
+		"                          to stderr\n"
+		"      --profile-hz=HZ     samples per second of guest CPU time\n"
+		"  -s, --symbols=PATH      guest ELF or map file for profiles\n"
+		"  -t, --trace=PATH        record every exit into binary PATH\n"
+		"      --record=PATH       log device inputs of the guest\n"
+		"      --replay=PATH       feed logged device inputs to the guest\n"
+		"                          instead of reading console input\n"
+		"      --prealloc[=THREADS]\n"
+		"                          populate guest memory before start,\n"
+		"                          by one thread per CPU by default\n"
+		"      --migrate-to=PATH   on SIGUSR2, move the running guest to\n"
+		"                          a process listening on UNIX socket\n"
+		"                          PATH\n"
+		"      --incoming=PATH     listen on UNIX socket PATH and run\n"
+		"                          a guest migrated there, memory size\n"
+		"                          has to match the source\n"
+		"      --cpuid-mask=LEAF[.SUBLEAF]:REG=[~]MASK\n"
+		"                          keep only MASK bits (or clear ~MASK\n"
+		"                          bits) of CPUID register REG (eax,\n"
+		"                          ebx, ecx or edx) passed through from\n"
+		"                          the host, e.g. 1:ecx=~0x10000000\n"
+		"                          hides AVX\n"
+		"      --reclaim=IDLE_MS   reclaim guest memory not written for\n"
+		"                          IDLE_MS milliseconds and report the\n"
+		"                          working set, excludes --migrate-to\n"
+		"                          and --pages=hugetlb\n"
+		"      --pageout           page idle memory out right away\n"
+		"                          rather than marking it cold\n"
+		"      --bench-startup=N   create, boot until the first exit and\n"
+		"                          destroy the guest N times, reporting\n"
+		"                          time spent per phase, instead of\n"
+		"                          running it, excludes options that\n"
+		"                          act on a running guest\n"
+		"      --pages=SIZE        back guest memory with 4k pages,\n"
+		"                          transparent huge pages (thp) or\n"
+		"                          reserved huge pages (hugetlb), the\n"
+		"                          host THP setting applies by default\n"
+		"      --cpu=CPU           pin the VCPU thread to host CPU\n"
+		"      --numa-node=NODE    allocate guest memory on NUMA node\n"
+		"                          NODE only\n"
+		"      --stats=PATH        keep KVM statistics of the guest in\n"
+		"                          PATH in Prometheus text format\n"
+		"      --stats-interval=MS\n"
+		"                          refresh statistics every MS\n"
+		"                          milliseconds, %d by default\n"
+		"      --repeat=N          run the guest N times in the same\n"
+		"                          virtual machine, restoring memory it\n"
+		"                          wrote and its registers in between,\n"
+		"                          excludes --reclaim and --migrate-to\n",
+		progname, DEFAULT_STATS_MS);
 
 	exit(stream == stdout ? EXIT_SUCCESS : EXIT_FAILURE);
 	/* NOTREACHED */
 }
 
+/**
+ * parse_cpuid_mask() - parse a CPUID mask command line argument
+ *
+ * @arg:  argument of LEAF[.SUBLEAF]:REG=[~]MASK form
+ * @mask: where to store parsed CPUID mask
+ *
+ * Return: zero on success, or -1 if the argument is malformed
+ */
+static int parse_cpuid_mask(const char *arg, struct cpuid_mask *mask)
+{
+	static const char *const regs[] = {
+		[CPUID_EAX] = "eax",
+		[CPUID_EBX] = "ebx",
+		[CPUID_ECX] = "ecx",
+		[CPUID_EDX] = "edx",
+	};
+	unsigned long value;
+	char *endptr;
+	int invert;
+
+	assert(arg != NULL);
+	assert(mask != NULL);
+
+	memset(mask, 0, sizeof(*mask));
+
+	value = strtoul(arg, &endptr, 0);
+	if (endptr == arg || value > UINT32_MAX)
+		return -1;
+	mask->function = value;
+
+	if (*endptr == '.') {
+		arg = endptr + 1;
+		value = strtoul(arg, &endptr, 0);
+		if (endptr == arg || value > UINT32_MAX)
+			return -1;
+		mask->index = value;
+	}
+
+	if (*endptr++ != ':')
+		return -1;
+
+	for (mask->reg = CPUID_EAX; mask->reg <= CPUID_EDX; mask->reg++)
+		if (strncmp(endptr, regs[mask->reg], 3) == 0 &&
+		    endptr[3] == '=')
+			break;
+
+	if (mask->reg > CPUID_EDX)
+		return -1;
+
+	arg = endptr + 4;
+	invert = *arg == '~';
+	arg += invert;
+
+	value = strtoul(arg, &endptr, 0);
+	if (endptr == arg || *endptr != '\0' || value > UINT32_MAX)
+		return -1;
+	mask->mask = invert ? ~value : value;
+
+	return 0;
+}
+
 /**
  * parse_command_line() - parse command line arguments and return
  *                        configuration structure
@@ -57,19 +410,69 @@ static void NORETURN usage(const char *progname, FILE *stream)
  */
 static const struct config *parse_command_line(int argc, char *argv[])
 {
-	char *num_bytes_endptr;
+	static const char *const pages[] = {
+		[PAGES_SMALL]   = "4k",
+		[PAGES_THP]     = "thp",
+		[PAGES_HUGETLB] = "hugetlb",
+	};
+	char *num_bytes_endptr, *endptr;
+	unsigned long value;
 	int opt;
 
+	static const struct option options[] = {
+		{ "help",           no_argument,       NULL, 'h'            },
+		{ "kvm",            required_argument, NULL, 'k'            },
+		{ "memory",         required_argument, NULL, 'm'            },
+		{ "profile",        required_argument, NULL, 'p'            },
+		{ "profile-hz",     required_argument, NULL, OPT_PROFILE_HZ },
+		{ "symbols",        required_argument, NULL, 's'            },
+		{ "trace",          required_argument, NULL, 't'            },
+		{ "record",         required_argument, NULL, OPT_RECORD     },
+		{ "replay",         required_argument, NULL, OPT_REPLAY     },
+		{ "prealloc",       optional_argument, NULL, OPT_PREALLOC   },
+		{ "migrate-to",     required_argument, NULL, OPT_MIGRATE_TO },
+		{ "incoming",       required_argument, NULL, OPT_INCOMING   },
+		{ "cpuid-mask",     required_argument, NULL, OPT_CPUID_MASK },
+		{ "reclaim",        required_argument, NULL, OPT_RECLAIM    },
+		{ "pageout",        no_argument,       NULL, OPT_PAGEOUT    },
+		{ "bench-startup",  required_argument, NULL, OPT_BENCH      },
+		{ "pages",          required_argument, NULL, OPT_PAGES      },
+		{ "cpu",            required_argument, NULL, OPT_CPU        },
+		{ "numa-node",      required_argument, NULL, OPT_NUMA_NODE  },
+		{ "stats",          required_argument, NULL, OPT_STATS      },
+		{ "stats-interval", required_argument, NULL, OPT_STATS_MS   },
+		{ "repeat",         required_argument, NULL, OPT_REPEAT     },
+		{ NULL,             0,                 NULL, 0              }
+	};
+
 	static struct config cfg = {
-		.kvm_path   = DEFAULT_KVM_PATH,
-		.image_path = DEFAULT_IMAGE_PATH,
-		.num_bytes  = DEFAULT_NUM_BYTES
+		.kvm_path     = DEFAULT_KVM_PATH,
+		.image_path   = DEFAULT_IMAGE_PATH,
+		.num_bytes    = DEFAULT_NUM_BYTES,
+		.profile_path = DEFAULT_PROFILE_PATH,
+		.profile_hz   = DEFAULT_PROFILE_HZ,
+		.symbols_path = DEFAULT_SYMBOLS_PATH,
+		.trace_path   = DEFAULT_TRACE_PATH,
+		.record_path  = DEFAULT_RECORD_PATH,
+		.replay_path  = DEFAULT_REPLAY_PATH,
+		.prealloc     = DEFAULT_PREALLOC,
+		.migrate_path = DEFAULT_MIGRATE_PATH,
+		.incoming     = DEFAULT_INCOMING,
+		.reclaim_ms   = DEFAULT_RECLAIM_MS,
+		.pageout      = DEFAULT_PAGEOUT,
+		.bench_runs   = DEFAULT_BENCH_RUNS,
+		.pages        = DEFAULT_PAGES,
+		.cpu          = DEFAULT_CPU,
+		.numa_node    = DEFAULT_NUMA_NODE,
+		.stats_path   = DEFAULT_STATS_PATH,
+		.stats_ms     = DEFAULT_STATS_MS,
+		.repeat       = DEFAULT_REPEAT
 	};
 
 	assert(argc > 0);
 	assert(argv != NULL);
 
-	while ((opt = getopt(argc, argv, "k:m:h")) != -1)
+	while ((opt = getopt_long(argc, argv, "k:m:p:s:t:h", options, NULL)) != -1)
 		switch (opt) {
 		case 'k':
 			cfg.kvm_path = optarg;
@@ -83,6 +486,128 @@ static const struct config *parse_command_line(int argc, char *argv[])
 			}
 			cfg.num_bytes <<= 20;
 			break;
+		case 'p':
+			cfg.profile_path = optarg;
+			break;
+		case OPT_PROFILE_HZ:
+			cfg.profile_hz = strtoul(optarg, &endptr, 10);
+			if (*endptr != '\0' || cfg.profile_hz == 0 ||
+			    cfg.profile_hz > 1000000) {
+				errorx("%s: wrong sampling frequency", optarg);
+				usage(argv[0], stderr);
+				/* NOTREACHED */
+			}
+			break;
+		case 's':
+			cfg.symbols_path = optarg;
+			break;
+		case 't':
+			cfg.trace_path = optarg;
+			break;
+		case OPT_RECORD:
+			cfg.record_path = optarg;
+			break;
+		case OPT_REPLAY:
+			cfg.replay_path = optarg;
+			break;
+		case OPT_PREALLOC:
+			if (optarg == NULL) {
+				cfg.prealloc = sysconf(_SC_NPROCESSORS_ONLN);
+				break;
+			}
+			cfg.prealloc = strtoul(optarg, &endptr, 10);
+			if (*endptr != '\0' || cfg.prealloc == 0) {
+				errorx("%s: wrong number of threads", optarg);
+				usage(argv[0], stderr);
+				/* NOTREACHED */
+			}
+			break;
+		case OPT_MIGRATE_TO:
+			cfg.migrate_path = optarg;
+			break;
+		case OPT_INCOMING:
+			cfg.incoming = optarg;
+			break;
+		case OPT_CPUID_MASK:
+			if (cfg.num_cpuid_masks >= MAX_CPUID_MASKS) {
+				errorx("too many CPUID masks");
+				usage(argv[0], stderr);
+				/* NOTREACHED */
+			}
+			if (parse_cpuid_mask(optarg, &cfg.cpuid_mask[
+					     cfg.num_cpuid_masks++]) != 0) {
+				errorx("%s: wrong CPUID mask", optarg);
+				usage(argv[0], stderr);
+				/* NOTREACHED */
+			}
+			break;
+		case OPT_RECLAIM:
+			cfg.reclaim_ms = strtoul(optarg, &endptr, 10);
+			if (*endptr != '\0' || cfg.reclaim_ms == 0) {
+				errorx("%s: wrong idle period", optarg);
+				usage(argv[0], stderr);
+				/* NOTREACHED */
+			}
+			break;
+		case OPT_PAGEOUT:
+			cfg.pageout = 1;
+			break;
+		case OPT_BENCH:
+			cfg.bench_runs = strtoul(optarg, &endptr, 10);
+			if (*endptr != '\0' || cfg.bench_runs == 0) {
+				errorx("%s: wrong number of iterations", optarg);
+				usage(argv[0], stderr);
+				/* NOTREACHED */
+			}
+			break;
+		case OPT_PAGES:
+			for (cfg.pages = PAGES_SMALL;
+			     cfg.pages <= PAGES_HUGETLB; cfg.pages++)
+				if (strcmp(optarg, pages[cfg.pages]) == 0)
+					break;
+			if (cfg.pages > PAGES_HUGETLB) {
+				errorx("%s: wrong page size", optarg);
+				usage(argv[0], stderr);
+				/* NOTREACHED */
+			}
+			break;
+		case OPT_CPU:
+			value = strtoul(optarg, &endptr, 10);
+			if (*endptr != '\0' || value >= CPU_SETSIZE) {
+				errorx("%s: wrong CPU number", optarg);
+				usage(argv[0], stderr);
+				/* NOTREACHED */
+			}
+			cfg.cpu = value;
+			break;
+		case OPT_NUMA_NODE:
+			value = strtoul(optarg, &endptr, 10);
+			if (*endptr != '\0' || value >= 8 * sizeof(long)) {
+				errorx("%s: wrong NUMA node", optarg);
+				usage(argv[0], stderr);
+				/* NOTREACHED */
+			}
+			cfg.numa_node = value;
+			break;
+		case OPT_STATS:
+			cfg.stats_path = optarg;
+			break;
+		case OPT_STATS_MS:
+			cfg.stats_ms = strtoul(optarg, &endptr, 10);
+			if (*endptr != '\0' || cfg.stats_ms == 0) {
+				errorx("%s: wrong statistics interval", optarg);
+				usage(argv[0], stderr);
+				/* NOTREACHED */
+			}
+			break;
+		case OPT_REPEAT:
+			cfg.repeat = strtoul(optarg, &endptr, 10);
+			if (*endptr != '\0' || cfg.repeat == 0) {
+				errorx("%s: wrong number of runs", optarg);
+				usage(argv[0], stderr);
+				/* NOTREACHED */
+			}
+			break;
 		case 'h':
 			/* FALLTHROUGH */
 		default:
@@ -90,8 +615,74 @@ static const struct config *parse_command_line(int argc, char *argv[])
 			/* NOTREACHED */
 		}
 
+	/* Both consume and reset the dirty page log */
+	if (cfg.reclaim_ms != 0 && cfg.migrate_path != NULL) {
+		errorx("cannot reclaim memory and migrate at the same time");
+		usage(argv[0], stderr);
+		/* NOTREACHED */
+	}
+
+	/* Resets rely on the dirty page log as well */
+	if (cfg.repeat > 1 &&
+	    (cfg.reclaim_ms != 0 || cfg.migrate_path != NULL)) {
+		errorx("cannot repeat runs while reclaiming memory or "
+		       "migrating");
+		usage(argv[0], stderr);
+		/* NOTREACHED */
+	}
+
+	/* Reserved huge pages can be neither marked cold nor paged out */
+	if (cfg.reclaim_ms != 0 && cfg.pages == PAGES_HUGETLB) {
+		errorx("cannot reclaim memory backed by reserved huge pages");
+		usage(argv[0], stderr);
+		/* NOTREACHED */
+	}
+
+	if (cfg.pages == PAGES_HUGETLB && cfg.num_bytes % HUGETLB_SIZE != 0) {
+		errorx("guest memory size has to be a multiple of %d MiB "
+		       "with reserved huge pages", HUGETLB_SIZE >> 20);
+		usage(argv[0], stderr);
+		/* NOTREACHED */
+	}
+
+	if (cfg.repeat > 1 && cfg.bench_runs != 0) {
+		errorx("startup benchmark cannot repeat runs");
+		usage(argv[0], stderr);
+		/* NOTREACHED */
+	}
+
+	/* Only the first exit is taken, without a session around it */
+	if (cfg.bench_runs != 0 &&
+	    (cfg.profile_path != NULL || cfg.trace_path != NULL ||
+	     cfg.record_path != NULL || cfg.replay_path != NULL ||
+	     cfg.migrate_path != NULL || cfg.reclaim_ms != 0 ||
+	     cfg.stats_path != NULL || cfg.cpu >= 0)) {
+		errorx("startup benchmark cannot profile, trace, record, "
+		       "replay, migrate, reclaim, export statistics or pin "
+		       "the VCPU thread");
+		usage(argv[0], stderr);
+		/* NOTREACHED */
+	}
+
+	if (cfg.incoming != NULL && cfg.bench_runs != 0) {
+		errorx("startup benchmark needs an image file");
+		usage(argv[0], stderr);
+		/* NOTREACHED */
+	}
+
+	if (cfg.incoming != NULL && argc - optind == 0)
+		return &cfg;
+
 	if (argc - optind != 1) {
-		errorx("missing image file name");
+		errorx(cfg.incoming != NULL ?
+		       "image file conflicts with incoming migration" :
+		       "missing image file name");
+		usage(argv[0], stderr);
+		/* NOTREACHED */
+	}
+
+	if (cfg.record_path != NULL && cfg.replay_path != NULL) {
+		errorx("cannot record and replay at the same time");
 		usage(argv[0], stderr);
 		/* NOTREACHED */
 	}
@@ -101,19 +692,120 @@ static const struct config *parse_command_line(int argc, char *argv[])
 	return &cfg;
 }
 
+/**
+ * monotonic_ns() - read monotonic clock
+ *
+ * Return: monotonic time in nanoseconds
+ */
+static uint64_t monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * end_phase() - record the end of a startup phase
+ *
+ * @t:     startup phase end timestamps, or NULL if not timing startup
+ * @phase: PHASE_* startup phase
+ */
+static void end_phase(uint64_t *t, unsigned phase)
+{
+	if (t != NULL)
+		t[phase] = monotonic_ns();
+}
+
+/**
+ * map_guest_memory() - map guest memory with page size and NUMA placement
+ *                      requested on command line
+ *
+ * @cfg: parsed command line arguments
+ *
+ * Return: guest memory of size cfg->num_bytes, or NULL if an error occurred
+ */
+static void *map_guest_memory(const struct config *cfg)
+{
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+	unsigned long nodemask;
+	void *mem;
+
+	assert(cfg != NULL);
+
+	if (cfg->pages == PAGES_HUGETLB)
+		flags |= MAP_HUGETLB;
+
+	mem = mmap(NULL, cfg->num_bytes, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (mem == MAP_FAILED) {
+		error("failed to map guest memory");
+		return NULL;
+	}
+
+	if ((cfg->pages == PAGES_SMALL &&
+	     madvise(mem, cfg->num_bytes, MADV_NOHUGEPAGE) != 0) ||
+	    (cfg->pages == PAGES_THP &&
+	     madvise(mem, cfg->num_bytes, MADV_HUGEPAGE) != 0)) {
+		error("failed to set guest memory page size");
+		goto err;
+	}
+
+	/* Guest memory is not touched yet, so nothing has to be moved */
+	if (cfg->numa_node >= 0) {
+		nodemask = 1UL << cfg->numa_node;
+		if (syscall(SYS_mbind, mem, cfg->num_bytes, MPOL_BIND,
+			    &nodemask, 8 * sizeof(nodemask) + 1, 0) != 0) {
+			error("failed to bind guest memory to NUMA node %d",
+			      cfg->numa_node);
+			goto err;
+		}
+	}
+
+	return mem;
+
+err:
+	munmap(mem, cfg->num_bytes);
+	return NULL;
+}
+
+/**
+ * pin_vcpu_thread() - pin the calling thread to a host CPU
+ *
+ * @cpu: host CPU number
+ *
+ * Return: zero on success, or -1 if an error occurred
+ */
+static int pin_vcpu_thread(int cpu)
+{
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+		error("failed to pin VCPU thread to CPU %d", cpu);
+		return -1;
+	}
+
+	return 0;
+}
+
 /**
  * create_virtual_machine() - create a virtual machine
  *
  * @cfg:      parsed command line arguments
  * @kvm:      KVM subsystem descriptor
  * @guestmem: allocated guest memory of size cfg->num_bytes
+ * @t:        where to store startup phase end timestamps, or NULL
  *
  * Return: virtual machine descriptor, or NULL if an error occurred
  */
 static struct vm *create_virtual_machine(const struct config *cfg,
-					 int kvm, void *guestmem)
+					 int kvm, void *guestmem, uint64_t *t)
 {
+	const struct cpuid_mask *mask;
 	struct vm *vm;
+	unsigned i;
 
 	assert(cfg != NULL);
 	assert(kvm > 0);
@@ -122,16 +814,44 @@ static struct vm *create_virtual_machine(const struct config *cfg,
 	vm = vm_create(kvm);
 	if (vm == NULL)
 		return NULL;
+	end_phase(t, PHASE_VM_CREATE);
+
+	/* Masks have to be in place before CPUID is given to the VCPU */
+	for (mask = cfg->cpuid_mask;
+	     mask < cfg->cpuid_mask + cfg->num_cpuid_masks; mask++)
+		if (vm_mask_cpuid(vm, mask->function, mask->index,
+				  mask->reg, mask->mask) != 0)
+			goto err;
 
 	if (vcpu_create(vm) < 0)
 		goto err;
+	end_phase(t, PHASE_VCPU_CREATE);
 
 	if (vm_attach_memory(vm, 0x0, cfg->num_bytes, guestmem) < 0)
 		goto err;
+	end_phase(t, PHASE_ATTACH_MEMORY);
 
-	if (binary_load(vm, cfg->image_path, 0,
-			BINARY_LOAD_PROTECTED | BINARY_LOAD_PAGED) != 0)
+	/* Reporting would add up to the timed phase */
+	if (cfg->prealloc != 0 &&
+	    prealloc_memory(vm, cfg->prealloc, t == NULL) != 0)
 		goto err;
+	end_phase(t, PHASE_PREALLOC);
+
+	/*
+	 * Migrated guests come with their memory and registers, others get
+	 * the last guest page reserved for kvmclock time information
+	 */
+	if (cfg->image_path != NULL &&
+	    binary_load(vm, cfg->image_path, 0, cfg->num_bytes - PAGE_SIZE,
+			BINARY_LOAD_PROTECTED | BINARY_LOAD_PAGED |
+			BINARY_LOAD_SIMD) != 0)
+		goto err;
+
+	for (i = 0; cfg->image_path != NULL && i < vm_get_num_vcpus(vm); i++)
+		if (vcpu_enable_kvmclock(vm, i, cfg->num_bytes - PAGE_SIZE +
+					 i * PVCLOCK_SIZE) != 0)
+			goto err;
+	end_phase(t, PHASE_BINARY_LOAD);
 
 	return vm;
 
@@ -140,68 +860,559 @@ err:
 	return NULL;
 }
 
+/**
+ * console_ready() - check whether console input can be read without blocking
+ *
+ * @s: virtual machine session
+ *
+ * Return: non-zero if console input is available
+ */
+static int console_ready(struct session *s)
+{
+	struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+
+	return !s->console_eof && poll(&pfd, 1, 0) == 1 &&
+	    (pfd.revents & (POLLIN | POLLHUP)) != 0;
+}
+
+/**
+ * port_in() - emulate a port read from devices connected to the host
+ *
+ * @s:    virtual machine session
+ * @port: port number
+ * @data: where to store read data
+ * @size: access size in bytes
+ */
+static void port_in(struct session *s, uint16_t port, uint8_t *data,
+		    size_t size)
+{
+	/* Nothing drives the bus on unassigned ports */
+	memset(data, 0xff, size);
+
+	if (port == UART_LSR)
+		data[0] = UART_LSR_THRE | UART_LSR_TEMT |
+		    (console_ready(s) ? UART_LSR_DR : 0);
+
+	if (port == UART_DATA) {
+		data[0] = 0;
+		if (console_ready(s) && read(STDIN_FILENO, data, 1) <= 0)
+			s->console_eof = 1;
+	}
+}
+
+/**
+ * guest_input() - provide data read by the guest from an emulated device
+ *
+ * When replaying, data comes from the device input log and the host
+ * devices are not accessed at all. When recording, data returned by host
+ * devices is logged.
+ *
+ * @s:     virtual machine session
+ * @type:  IOLOG_* event type
+ * @addr:  port number or MMIO guest physical address
+ * @data:  where to store read data
+ * @size:  access size in bytes
+ * @count: number of accesses
+ *
+ * Return: zero on success, or -1 if an error occurred
+ */
+static int guest_input(struct session *s, unsigned type, uint64_t addr,
+		       uint8_t *data, size_t size, size_t count)
+{
+	size_t i;
+
+	if (s->replay != NULL)
+		return iolog_replay(s->replay, s->num_exits, type, addr,
+				    data, size * count);
+
+	for (i = 0; i < count; i++)
+		if (type == IOLOG_PORT_IN)
+			port_in(s, addr, data + i * size, size);
+		else
+			memset(data + i * size, 0xff, size);
+
+	if (s->record != NULL)
+		return iolog_record(s->record, s->num_exits, type, addr,
+				    data, size * count);
+
+	return 0;
+}
+
+/**
+ * handle_io() - handle a port access exit
+ *
+ * @s:    virtual machine session
+ * @vcpu: virtual CPU parameter block
+ *
+ * Return: zero on success, or -1 if an error occurred
+ */
+static int handle_io(struct session *s, struct kvm_run *vcpu)
+{
+	uint8_t *data = (uint8_t *) vcpu + vcpu->io.data_offset;
+
+	if (vcpu->io.direction == KVM_EXIT_IO_IN)
+		return guest_input(s, IOLOG_PORT_IN, vcpu->io.port, data,
+				   vcpu->io.size, vcpu->io.count);
+
+	if (vcpu->io.port == UART_DATA)
+		write(STDOUT_FILENO, data, vcpu->io.size * vcpu->io.count);
+
+	return 0;
+}
+
+/**
+ * handle_mmio() - handle an access to unassigned guest physical memory
+ *
+ * @s:    virtual machine session
+ * @vcpu: virtual CPU parameter block
+ *
+ * Return: zero on success, or -1 if an error occurred
+ */
+static int handle_mmio(struct session *s, struct kvm_run *vcpu)
+{
+	if (vcpu->mmio.is_write)
+		return 0;
+
+	return guest_input(s, IOLOG_MMIO_READ, vcpu->mmio.phys_addr,
+			   vcpu->mmio.data, vcpu->mmio.len, 1);
+}
+
 /**
  * run_virtual_machine() - start a run loop for a virtual machine
  *
- * @vm: virtual machine to run
+ * @s: session of a virtual machine to run, with the profiler attached
  *
  * Return: zero on clean virtual machine exit, or a non-zero value on error
  */
-static int run_virtual_machine(struct vm *vm)
+static int run_virtual_machine(struct session *s)
 {
 	struct kvm_run *vcpu;
+	struct vm *vm;
+	int ret;
 
-	assert(vm != NULL);
+	assert(s != NULL);
+	assert(s->vm != NULL);
 
+	vm = s->vm;
 	vcpu = vcpu_get(vm, BOOT_VCPU);
 	for (/* NOTHING */; /* NOTHING */; /* NOTHING */) {
 		if (vcpu_run(vm, 0) != 0)
 			return EXIT_FAILURE;
 
-		if (vcpu->exit_reason == KVM_EXIT_HLT)
+		if (s->trace != NULL)
+			trace_exit(s->trace, BOOT_VCPU, vcpu);
+
+		switch (vcpu->exit_reason) {
+		case KVM_EXIT_HLT:
 			return EXIT_SUCCESS;
 
-		if (vcpu->exit_reason == KVM_EXIT_IO &&
-		    vcpu->io.port == 0x3f8 &&
-		    vcpu->io.direction == KVM_EXIT_IO_OUT)
-		{
-			write(STDOUT_FILENO,
-			      (const void *) vcpu + vcpu->io.data_offset,
-			      vcpu->io.size * vcpu->io.count);
+		case KVM_EXIT_INTR:
+			/* Host initiated, so not counted as a guest exit */
+			if (s->prof != NULL)
+				profile_sample(s->prof, BOOT_VCPU);
+			if (s->mig != NULL && migrate_poll(s->mig, BOOT_VCPU))
+				return EXIT_SUCCESS;
+			continue;
+
+		case KVM_EXIT_IO:
+			ret = handle_io(s, vcpu);
+			break;
+
+		case KVM_EXIT_MMIO:
+			ret = handle_mmio(s, vcpu);
+			break;
+
+		default:
+			ret = 0;
+			break;
 		}
+
+		if (ret != 0)
+			return EXIT_FAILURE;
+
+		s->num_exits++;
 	}
 
 	/* NOTREACHED */
 	return EXIT_FAILURE;
 }
 
+/**
+ * report_profile() - write profiling results
+ *
+ * @cfg:  parsed command line arguments
+ * @prof: guest profiler
+ *
+ * Return: zero on success, or -1 if an error occurred
+ */
+static int report_profile(const struct config *cfg, struct profile *prof)
+{
+	struct symtab *tab = NULL;
+	FILE *folded;
+	int ret;
+
+	assert(cfg != NULL);
+	assert(cfg->profile_path != NULL);
+	assert(prof != NULL);
+
+	if (cfg->symbols_path != NULL) {
+		tab = symtab_load(cfg->symbols_path);
+		if (tab == NULL)
+			return -1;
+	}
+
+	folded = fopen(cfg->profile_path, "w");
+	if (folded == NULL) {
+		error("%s", cfg->profile_path);
+		ret = -1;
+	} else {
+		ret = profile_report(prof, tab, stderr, folded);
+		if (fclose(folded) != 0) {
+			error("%s", cfg->profile_path);
+			ret = -1;
+		}
+	}
+
+	if (tab != NULL)
+		symtab_free(tab);
+
+	return ret;
+}
+
+/**
+ * start_session() - attach facilities requested on command line to a
+ *                   virtual machine
+ *
+ * @cfg: parsed command line arguments
+ * @s:   session with a created virtual machine
+ *
+ * Return: zero on success, or -1 if an error occurred
+ */
+static int start_session(const struct config *cfg, struct session *s)
+{
+	assert(cfg != NULL);
+	assert(s != NULL);
+	assert(s->vm != NULL);
+
+	if (cfg->profile_path != NULL) {
+		s->prof = profile_create(s->vm, cfg->profile_hz);
+		if (s->prof == NULL)
+			return -1;
+	}
+
+	if (cfg->trace_path != NULL) {
+		s->trace = trace_create(s->vm, cfg->trace_path);
+		if (s->trace == NULL)
+			return -1;
+	}
+
+	if (cfg->record_path != NULL) {
+		s->record = iolog_open(cfg->record_path, IOLOG_RECORD);
+		if (s->record == NULL)
+			return -1;
+	}
+
+	if (cfg->replay_path != NULL) {
+		s->replay = iolog_open(cfg->replay_path, IOLOG_REPLAY);
+		if (s->replay == NULL)
+			return -1;
+	}
+
+	if (cfg->incoming != NULL && migrate_receive(s->vm, cfg->incoming) != 0)
+		return -1;
+
+	if (cfg->migrate_path != NULL) {
+		s->mig = migrate_start(s->vm, cfg->migrate_path);
+		if (s->mig == NULL)
+			return -1;
+	}
+
+	if (cfg->reclaim_ms != 0) {
+		s->reclaim = reclaim_start(s->vm, cfg->reclaim_ms, cfg->pageout);
+		if (s->reclaim == NULL)
+			return -1;
+	}
+
+	if (cfg->stats_path != NULL) {
+		s->stats = stats_start(s->vm, cfg->stats_path, cfg->stats_ms,
+				       s->reclaim);
+		if (s->stats == NULL)
+			return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * finish_session() - report results of and detach facilities from a
+ *                    virtual machine
+ *
+ * @cfg: parsed command line arguments
+ * @s:   session started with start_session()
+ *
+ * Return: zero on success, or -1 if an error occurred
+ */
+static int finish_session(const struct config *cfg, struct session *s)
+{
+	int ret = 0;
+
+	assert(cfg != NULL);
+	assert(s != NULL);
+
+	if (s->mig != NULL && migrate_finish(s->mig) != 0)
+		ret = -1;
+
+	/* Reclaim estimates are exported until the very end */
+	if (s->stats != NULL && stats_stop(s->stats) != 0)
+		ret = -1;
+
+	if (s->reclaim != NULL && reclaim_stop(s->reclaim) != 0)
+		ret = -1;
+
+	if (s->trace != NULL && trace_destroy(s->trace) != 0)
+		ret = -1;
+
+	if (s->record != NULL && iolog_close(s->record) != 0)
+		ret = -1;
+
+	if (s->replay != NULL && iolog_close(s->replay) != 0)
+		ret = -1;
+
+	if (s->prof != NULL) {
+		if (report_profile(cfg, s->prof) != 0)
+			ret = -1;
+		profile_destroy(s->prof);
+	}
+
+	return ret;
+}
+
+/**
+ * start_once() - create a virtual machine, run it until its first exit and
+ *                destroy it, timing every startup phase
+ *
+ * @cfg: parsed command line arguments
+ * @t:   where to store startup phase end timestamps
+ *
+ * Return: zero on success, or -1 if an error occurred
+ */
+static int start_once(const struct config *cfg, uint64_t *t)
+{
+	void *guestmem;
+	struct vm *vm;
+	int kvm, ret = -1;
+
+	end_phase(t, PHASE_START);
+
+	kvm = kvm_open(cfg->kvm_path);
+	if (kvm < 0)
+		return -1;
+	end_phase(t, PHASE_KVM_OPEN);
+
+	guestmem = map_guest_memory(cfg);
+	if (guestmem == NULL) {
+		kvm_close(kvm);
+		return -1;
+	}
+	end_phase(t, PHASE_MMAP);
+
+	vm = create_virtual_machine(cfg, kvm, guestmem, t);
+	if (vm != NULL) {
+		ret = vcpu_run(vm, BOOT_VCPU);
+		end_phase(t, PHASE_FIRST_RUN);
+		vm_destroy(vm);
+	}
+
+	munmap(guestmem, cfg->num_bytes);
+	kvm_close(kvm);
+	end_phase(t, PHASE_TEARDOWN);
+
+	return ret;
+}
+
+/**
+ * compare_u64() - qsort(3) comparator ordering 64-bit unsigned integers
+ *
+ * @a: first integer
+ * @b: second integer
+ *
+ * Return: negative, zero or positive value as required by qsort(3)
+ */
+static int compare_u64(const void *a, const void *b)
+{
+	const uint64_t *x = a, *y = b;
+
+	return (*x > *y) - (*x < *y);
+}
+
+/**
+ * bench_startup() - time startup phases over a number of iterations and
+ *                   report their medians and tails
+ *
+ * @cfg: parsed command line arguments
+ *
+ * Return: zero on success, or -1 if an error occurred
+ */
+static int bench_startup(const struct config *cfg)
+{
+	/* Durations of whole iterations take the PHASE_START row */
+	static const char *const phase_names[NUM_PHASES] = {
+		[PHASE_START]         = "total",
+		[PHASE_KVM_OPEN]      = "kvm_open",
+		[PHASE_MMAP]          = "mmap",
+		[PHASE_VM_CREATE]     = "vm_create",
+		[PHASE_VCPU_CREATE]   = "vcpu_create",
+		[PHASE_ATTACH_MEMORY] = "vm_attach_memory",
+		[PHASE_PREALLOC]      = "prealloc",
+		[PHASE_BINARY_LOAD]   = "binary_load",
+		[PHASE_FIRST_RUN]     = "first vcpu_run",
+		[PHASE_TEARDOWN]      = "teardown",
+	};
+	unsigned i, n = cfg->bench_runs, p;
+	uint64_t t[NUM_PHASES], *d, *row;
+
+	d = calloc((size_t) n * NUM_PHASES, sizeof(*d));
+	if (d == NULL) {
+		error("failed to allocate startup timings");
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (start_once(cfg, t) != 0) {
+			free(d);
+			return -1;
+		}
+
+		d[PHASE_START * n + i] = t[NUM_PHASES - 1] - t[PHASE_START];
+		for (p = PHASE_START + 1; p < NUM_PHASES; p++)
+			d[p * n + i] = t[p] - t[p - 1];
+	}
+
+	printf("startup: %u iterations, %zu MiB guest memory, times in us\n"
+	       "%-18s %10s %10s %10s %10s\n", n, cfg->num_bytes >> 20,
+	       "phase", "median", "p90", "p99", "max");
+
+	/* Phases in order, then the total */
+	for (p = PHASE_START + 1; p <= NUM_PHASES; p++) {
+		row = &d[(p % NUM_PHASES) * n];
+		qsort(row, n, sizeof(*row), compare_u64);
+		printf("%-18s %10.1f %10.1f %10.1f %10.1f\n",
+		       phase_names[p % NUM_PHASES], row[(n - 1) / 2] / 1e3,
+		       row[(n - 1) * 90 / 100] / 1e3,
+		       row[(n - 1) * 99 / 100] / 1e3, row[n - 1] / 1e3);
+	}
+
+	free(d);
+
+	return 0;
+}
+
+/**
+ * run_repeatedly() - run a virtual machine as many times as requested,
+ *                    resetting it to its initial state between runs, and
+ *                    report reset times
+ *
+ * @cfg: parsed command line arguments
+ * @s:   session of a virtual machine to run
+ *
+ * Return: zero if every run exited cleanly, or a non-zero value on error
+ */
+static int run_repeatedly(const struct config *cfg, struct session *s)
+{
+	struct snapshot *snap = NULL;
+	unsigned i, n = cfg->repeat - 1;
+	uint64_t *d, t, num_pages = 0;
+	int ret = EXIT_FAILURE;
+	ssize_t restored;
+
+	assert(cfg != NULL);
+	assert(s != NULL);
+
+	d = calloc(n + 1, sizeof(*d));
+	if (d == NULL) {
+		error("failed to allocate reset timings");
+		return EXIT_FAILURE;
+	}
+
+	/* Taken before profiling, so that copying memory is not sampled */
+	if (n != 0) {
+		snap = snapshot_take(s->vm);
+		if (snap == NULL)
+			goto out;
+	}
+
+	if (s->prof != NULL && profile_attach(s->prof, BOOT_VCPU) != 0)
+		goto out;
+
+	for (i = 0; i <= n; i++) {
+		if (i != 0) {
+			t = monotonic_ns();
+			restored = snapshot_restore(snap);
+			if (restored < 0) {
+				ret = EXIT_FAILURE;
+				goto out;
+			}
+			d[i - 1] = monotonic_ns() - t;
+			num_pages += restored;
+		}
+
+		ret = run_virtual_machine(s);
+		if (ret != EXIT_SUCCESS)
+			goto out;
+	}
+
+	if (n != 0) {
+		qsort(d, n, sizeof(*d), compare_u64);
+		fprintf(stderr, "repeat: %u runs, %.1f KiB restored per reset, "
+			"reset median %.1f us, max %.1f us\n", n + 1,
+			(double) num_pages * PAGE_SIZE / 1024 / n,
+			d[(n - 1) / 2] / 1e3, d[n - 1] / 1e3);
+	}
+
+out:
+	if (snap != NULL)
+		snapshot_free(snap);
+	free(d);
+
+	return ret;
+}
+
 int main(int argc, char *argv[])
 {
+	struct session s;
 	const struct config *cfg;
 	int ret = EXIT_FAILURE;
 	void *guestmem;
-	struct vm *vm;
 	int kvm;
 
 	cfg = parse_command_line(argc, argv);
 	assert(cfg != NULL);
 
+	if (cfg->bench_runs != 0)
+		return bench_startup(cfg) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+
 	kvm = kvm_open(cfg->kvm_path);
 	if (kvm < 0)
 		return EXIT_FAILURE;
 
-	guestmem = mmap(0, cfg->num_bytes, PROT_READ | PROT_WRITE,
-			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-	if (guestmem == MAP_FAILED) {
+	guestmem = map_guest_memory(cfg);
+	if (guestmem == NULL) {
 		kvm_close(kvm);
-		fail("mmap");
-		/* NOTREACHED */
+		return EXIT_FAILURE;
 	}
 
-	vm = create_virtual_machine(cfg, kvm, guestmem);
-	if (vm != NULL) {
-		ret = run_virtual_machine(vm);
-		vm_destroy(vm);
+	memset(&s, 0, sizeof(s));
+	s.vm = create_virtual_machine(cfg, kvm, guestmem, NULL);
+	if (s.vm != NULL) {
+		/* Helper threads are started by then and stay unpinned */
+		if (start_session(cfg, &s) == 0 &&
+		    (cfg->cpu < 0 || pin_vcpu_thread(cfg->cpu) == 0))
+			ret = run_repeatedly(cfg, &s);
+
+		if (finish_session(cfg, &s) != 0)
+			ret = EXIT_FAILURE;
+
+		vm_destroy(s.vm);
 	}
 
 	munmap(guestmem, cfg->num_bytes);
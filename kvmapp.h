@@ -42,4 +42,20 @@
 # define NORETURN
 #endif /* __GNUC__ */
 
+/**
+ * ALIGNED() - portable variable alignment attribute
+ *
+ * @n: alignment in bytes
+ */
+#ifdef __GNUC__
+# define ALIGNED(n) __attribute__((aligned(n)))
+#else /* __GNUC__ */
+# define ALIGNED(n)
+#endif /* __GNUC__ */
+
+/**
+ * CACHE_LINE_SIZE - host cache line size, used to avoid false sharing
+ */
+#define CACHE_LINE_SIZE 64
+
 #endif /* _KVMAPP_H */
@@ -1,15 +1,18 @@
 #include <assert.h>
 #include <errno.h>
+#include <inttypes.h>
 
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/user.h>
 #include <unistd.h>
 
 #include <linux/kvm.h>
 
 #include "binary.h"
+#include "cimage.h"
 #include "kvm.h"
 #include "kvmapp.h"
 #include "log.h"
@@ -18,24 +21,42 @@
 /**
  * load_image() - load binary file into a virtual machine
  *
- * @vm:   virtual machine descriptor
- * @path: path to a binary file
- * @base: guest physical load address
+ * Compressed images are recognized by their signature and decompressed.
+ * Others are read straight into guest memory, even across memory regions.
+ *
+ * @vm:    virtual machine descriptor
+ * @path:  path to a binary file
+ * @base:  guest physical load address
+ * @limit: guest physical address the image has to end before
  *
  * Return: size of loaded image, or -1 if an error occurred
  */
-static ssize_t load_image(struct vm *vm, const char *path, uintptr_t base)
+static ssize_t load_image(struct vm *vm, const char *path, uintptr_t base,
+			  uintptr_t limit)
 {
+	struct iovec iov[MAX_MEMSLOTS];
 	ssize_t ret = -1;
 	struct stat st;
-	void *dst;
-	int fd;
+	int fd, n;
 
 	fd = open(path, O_RDONLY);
+	if (fd > 0 && cimage_probe(fd)) {
+		ret = cimage_load(vm, fd, path, base, limit);
+		close(fd);
+		return ret;
+	}
+
 	if (fd > 0 && fstat(fd, &st) == 0) {
-		dst = vm_get_memory(vm, base, st.st_size);
-		if (dst != NULL)
-			ret = read(fd, dst, st.st_size);
+		if ((uintmax_t) st.st_size > limit - base) {
+			errorx("%s: image does not fit below 0x%" PRIxPTR,
+			       path, limit);
+			close(fd);
+			return -1;
+		}
+
+		n = vm_guest_iov(vm, base, st.st_size, iov, MAX_MEMSLOTS);
+		if (n >= 0)
+			ret = readv(fd, iov, n);
 	}
 
 	if (ret < 0 && errno != 0)
@@ -50,33 +71,59 @@ static ssize_t load_image(struct vm *vm, const char *path, uintptr_t base)
 /**
  * binary_load() - bootstrap virtual machine from a binary file
  *
+ * The image, the stack above it and the page directory on top of the
+ * stack all have to end before @limit, so that memory from there on can
+ * be reserved for other uses.
+ *
  * @vm:    virtual machine descriptor
  * @path:  path to a binary file with bootstrap code
  * @base:  guest physical load address
+ * @limit: guest physical address the loader has to stay below
  * @flags: loader flags, specifying initial machine state
  *
  * Return: zero on success, or -1 if an error occurred
  */
-int binary_load(struct vm *vm, const char *path, uintptr_t base, int flags)
+int binary_load(struct vm *vm, const char *path, uintptr_t base,
+		uintptr_t limit, int flags)
 {
+	struct vcpu_state state;
 	ssize_t image_size;
-	uintptr_t stack;
+	uintptr_t stack, end;
 	int ret = -1;
 
 	assert(vm != NULL);
 	assert(path != NULL);
-	assert((flags & ~(BINARY_LOAD_PROTECTED | BINARY_LOAD_PAGED)) == 0);
+	assert(base <= limit);
+	assert((flags & ~(BINARY_LOAD_PROTECTED | BINARY_LOAD_PAGED |
+			  BINARY_LOAD_SIMD)) == 0);
 
-	image_size = load_image(vm, path, base);
+	image_size = load_image(vm, path, base, limit);
 	if (image_size > 0) {
 		stack = round_up(base + image_size + PAGE_SIZE, PAGE_SIZE);
-		ret = vcpu_init(vm, BOOT_VCPU, base, stack);
+		/* Page directory takes the page right above the stack */
+		end = stack;
+		if ((flags & BINARY_LOAD_PAGED) != 0)
+			end += PAGE_SIZE;
+		if (end > limit) {
+			errorx("%s: no room for stack and page directory "
+			       "below 0x%" PRIxPTR, path, limit);
+			return -1;
+		}
+
+		vcpu_state_begin(&state, vm, BOOT_VCPU);
+		ret = vcpu_init(&state, base, stack);
 
 		if ((flags & BINARY_LOAD_PROTECTED) != 0)
-			ret |= vcpu_enable_protected_mode(vm, BOOT_VCPU);
+			ret |= vcpu_enable_protected_mode(&state);
 
 		if ((flags & BINARY_LOAD_PAGED) != 0)
-			ret |= vcpu_enable_paged_mode(vm, BOOT_VCPU, stack);
+			ret |= vcpu_enable_paged_mode(&state, stack);
+
+		if ((flags & BINARY_LOAD_SIMD) != 0)
+			ret |= vcpu_enable_simd(&state);
+
+		if (ret == 0)
+			ret = vcpu_state_commit(&state);
 	}
 
 	if (ret != 0)
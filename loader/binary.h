@@ -11,13 +11,15 @@ struct vm;
  * @BINARY_LOAD_UNRESTRICTED: load virtual machine in unrestricted mode
  * @BINARY_LOAD_PROTECTED:    load virtual machine in protected mode
  * @BINARY_LOAD_PAGED:        load virtual machine in paged mode
+ * @BINARY_LOAD_SIMD:         enable SSE/AVX state on the bootstrap VCPU
  */
 enum {
 	BINARY_LOAD_UNRESTRICTED = 0,
 	BINARY_LOAD_PROTECTED    = 1,
 	BINARY_LOAD_PAGED        = 2,
+	BINARY_LOAD_SIMD         = 4,
 };
 
-int binary_load(struct vm *, const char *, uintptr_t, int);
+int binary_load(struct vm *, const char *, uintptr_t, uintptr_t, int);
 
 #endif /* _LOADER_BINARY_H */
@@ -0,0 +1,249 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "cimage.h"
+#include "kvm.h"
+#include "log.h"
+#include "lz.h"
+
+/**
+ * enum
+ *
+ * @MAX_THREADS: maximum number of decompressing threads
+ */
+enum {
+	MAX_THREADS = 64,
+};
+
+/**
+ * struct decoder - compressed image being loaded
+ *
+ * @path:       image file path
+ * @fd:         image file descriptor
+ * @hdr:        image header
+ * @block:      block descriptors
+ * @dst:        host address of guest memory to load the image into
+ * @next_block: index of the next block to claim by a thread
+ * @ret:        zero on success, or -1 if any thread failed
+ */
+struct decoder {
+	const char *path;
+	int fd;
+	struct cimage_header hdr;
+	struct cimage_block *block;
+	uint8_t *dst;
+	uint32_t next_block;
+	int ret;
+};
+
+/**
+ * cimage_probe() - check whether a file is a compressed image
+ *
+ * @fd: file descriptor
+ *
+ * Return: non-zero if the file starts with CIMAGE_MAGIC
+ */
+int cimage_probe(int fd)
+{
+	char magic[sizeof(CIMAGE_MAGIC) - 1];
+
+	return pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+	    memcmp(magic, CIMAGE_MAGIC, sizeof(magic)) == 0;
+}
+
+/**
+ * load_block() - place one block into guest memory
+ *
+ * All-zero blocks are skipped, as guest memory is freshly mapped.
+ *
+ * @d:   compressed image
+ * @i:   block index
+ * @buf: scratch buffer of image block size
+ *
+ * Return: zero on success, or -1 if an error occurred
+ */
+static int load_block(struct decoder *d, uint32_t i, uint8_t *buf)
+{
+	const struct cimage_block *b = &d->block[i];
+	uint64_t start = (uint64_t) i * d->hdr.block_size;
+	size_t len;
+
+	len = d->hdr.image_size - start < d->hdr.block_size ?
+	    d->hdr.image_size - start : d->hdr.block_size;
+
+	switch (b->type) {
+	case CIMAGE_BLOCK_ZERO:
+		return 0;
+
+	case CIMAGE_BLOCK_RAW:
+		if (b->size == len &&
+		    pread(d->fd, d->dst + start, len, b->offset) ==
+		    (ssize_t) len)
+			return 0;
+		break;
+
+	case CIMAGE_BLOCK_LZ:
+		if (b->size <= d->hdr.block_size &&
+		    pread(d->fd, buf, b->size, b->offset) ==
+		    (ssize_t) b->size &&
+		    lz_decompress(buf, b->size, d->dst + start, len) ==
+		    (ssize_t) len)
+			return 0;
+		break;
+	}
+
+	errorx("%s: corrupted block #%u", d->path, i);
+
+	return -1;
+}
+
+/**
+ * decoder_thread() - load blocks until none is left or an error occurs
+ *
+ * Blocks are claimed one at a time, so that threads stay busy regardless of
+ * how well each block compresses.
+ *
+ * @arg: compressed image
+ *
+ * Return: NULL
+ */
+static void *decoder_thread(void *arg)
+{
+	struct decoder *d = arg;
+	uint8_t *buf;
+	uint32_t i;
+
+	buf = malloc(d->hdr.block_size);
+	if (buf == NULL) {
+		error("failed to allocate decompression buffer");
+		__atomic_store_n(&d->ret, -1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	while (__atomic_load_n(&d->ret, __ATOMIC_RELAXED) == 0) {
+		i = __atomic_fetch_add(&d->next_block, 1, __ATOMIC_RELAXED);
+		if (i >= d->hdr.num_blocks)
+			break;
+
+		if (load_block(d, i, buf) != 0)
+			__atomic_store_n(&d->ret, -1, __ATOMIC_RELAXED);
+	}
+
+	free(buf);
+
+	return NULL;
+}
+
+/**
+ * read_index() - read and validate compressed image header and block
+ *                descriptors
+ *
+ * @d: compressed image with @path and @fd set
+ *
+ * Return: zero on success, or -1 if an error occurred
+ */
+static int read_index(struct decoder *d)
+{
+	struct cimage_header *hdr = &d->hdr;
+	size_t size;
+
+	if (pread(d->fd, hdr, sizeof(*hdr), 0) != sizeof(*hdr) ||
+	    memcmp(hdr->magic, CIMAGE_MAGIC, sizeof(hdr->magic)) != 0 ||
+	    hdr->block_size == 0 ||
+	    hdr->block_size > CIMAGE_MAX_BLOCK_SIZE ||
+	    hdr->num_blocks != (hdr->image_size + hdr->block_size - 1) /
+	    hdr->block_size) {
+		errorx("%s: not a compressed image", d->path);
+		return -1;
+	}
+
+	size = (size_t) hdr->num_blocks * sizeof(*d->block);
+	d->block = malloc(size);
+	if (d->block == NULL) {
+		error("failed to allocate compressed image index");
+		return -1;
+	}
+
+	if (pread(d->fd, d->block, size, sizeof(*hdr)) != (ssize_t) size) {
+		errorx("%s: truncated compressed image index", d->path);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * cimage_load() - decompress a compressed image into a virtual machine
+ *
+ * Blocks are decompressed by one thread per online CPU straight into guest
+ * memory.
+ *
+ * @vm:    virtual machine descriptor
+ * @fd:    compressed image file descriptor
+ * @path:  compressed image file path
+ * @base:  guest physical load address
+ * @limit: guest physical address the image has to end before
+ *
+ * Return: uncompressed image size, or -1 if an error occurred
+ */
+ssize_t cimage_load(struct vm *vm, int fd, const char *path, uintptr_t base,
+		    uintptr_t limit)
+{
+	pthread_t thread[MAX_THREADS];
+	unsigned i, num_threads;
+	struct decoder d;
+	long cpus;
+
+	assert(vm != NULL);
+	assert(path != NULL);
+
+	memset(&d, 0, sizeof(d));
+	d.path = path;
+	d.fd = fd;
+
+	if (read_index(&d) != 0)
+		goto err;
+
+	if (base > limit || d.hdr.image_size > limit - base) {
+		errorx("%s: image does not fit below 0x%" PRIxPTR, path, limit);
+		goto err;
+	}
+
+	d.dst = vm_get_memory(vm, base, d.hdr.image_size);
+	if (d.dst == NULL)
+		goto err;
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	num_threads = cpus > 0 ? cpus : 1;
+	if (num_threads > MAX_THREADS)
+		num_threads = MAX_THREADS;
+	if (num_threads > d.hdr.num_blocks)
+		num_threads = d.hdr.num_blocks;
+
+	for (i = 0; i < num_threads; i++)
+		if (pthread_create(&thread[i], NULL, decoder_thread, &d) != 0) {
+			errorx("failed to start decompressing thread");
+			__atomic_store_n(&d.ret, -1, __ATOMIC_RELAXED);
+			break;
+		}
+
+	num_threads = i;
+	for (i = 0; i < num_threads; i++)
+		pthread_join(thread[i], NULL);
+
+	if (d.ret != 0)
+		goto err;
+
+	free(d.block);
+
+	return d.hdr.image_size;
+
+err:
+	free(d.block);
+	return -1;
+}
@@ -0,0 +1,70 @@
+#ifndef _LOADER_CIMAGE_H
+#define _LOADER_CIMAGE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+struct vm;
+
+/**
+ * CIMAGE_MAGIC - compressed image file signature
+ */
+#define CIMAGE_MAGIC "KVMCIMG1"
+
+/**
+ * enum
+ *
+ * @CIMAGE_BLOCK_SIZE:     default uncompressed block size
+ * @CIMAGE_MAX_BLOCK_SIZE: largest accepted uncompressed block size
+ */
+enum {
+	CIMAGE_BLOCK_SIZE     = 256 << 10,
+	CIMAGE_MAX_BLOCK_SIZE = 64 << 20,
+};
+
+/**
+ * enum - compressed image block types
+ *
+ * @CIMAGE_BLOCK_ZERO: all-zero block, without stored data
+ * @CIMAGE_BLOCK_RAW:  block stored uncompressed
+ * @CIMAGE_BLOCK_LZ:   block compressed by lz_compress()
+ */
+enum {
+	CIMAGE_BLOCK_ZERO,
+	CIMAGE_BLOCK_RAW,
+	CIMAGE_BLOCK_LZ,
+};
+
+/**
+ * struct cimage_header - compressed image file header, followed by
+ *                        @num_blocks block descriptors and block data
+ *
+ * @magic:      CIMAGE_MAGIC without terminating null character
+ * @block_size: uncompressed size of every block but the last one
+ * @num_blocks: number of blocks
+ * @image_size: uncompressed image size
+ */
+struct cimage_header {
+	char magic[8];
+	uint32_t block_size;
+	uint32_t num_blocks;
+	uint64_t image_size;
+};
+
+/**
+ * struct cimage_block - compressed image block descriptor
+ *
+ * @offset: file offset of block data
+ * @size:   size of block data, at most block size of the image
+ * @type:   CIMAGE_BLOCK_* block type
+ */
+struct cimage_block {
+	uint64_t offset;
+	uint32_t size;
+	uint32_t type;
+};
+
+int cimage_probe(int);
+ssize_t cimage_load(struct vm *, int, const char *, uintptr_t, uintptr_t);
+
+#endif /* _LOADER_CIMAGE_H */
@@ -0,0 +1,287 @@
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+/*
+ * Compressed data is a sequence of sequences, each made of:
+ *
+ *   - a token byte, literal run length in the high nibble and match length
+ *     minus LZ_MIN_MATCH in the low nibble, 15 meaning that the length
+ *     continues in following bytes, each adding up to 255;
+ *   - literal length continuation bytes, if any;
+ *   - literal bytes;
+ *   - little endian 16-bit match offset, back from the current position;
+ *   - match length continuation bytes, if any.
+ *
+ * The last sequence ends right after its literal bytes.
+ */
+
+/**
+ * enum
+ *
+ * @LZ_MIN_MATCH:  shortest encoded match
+ * @LZ_MAX_OFFSET: farthest match distance
+ * @LZ_HASH_BITS:  logarithm of match finder hash table size
+ * @LZ_RUN_MASK:   token nibble value meaning that a length continues
+ */
+enum {
+	LZ_MIN_MATCH  = 4,
+	LZ_MAX_OFFSET = 65535,
+	LZ_HASH_BITS  = 13,
+	LZ_RUN_MASK   = 15,
+};
+
+/**
+ * read32() - read four possibly unaligned bytes
+ *
+ * @p: source
+ *
+ * Return: value read
+ */
+static uint32_t read32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+
+	return v;
+}
+
+/**
+ * hash() - hash four bytes into match finder table index
+ *
+ * @v: four bytes to hash
+ *
+ * Return: hash table index
+ */
+static unsigned hash(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/**
+ * put_length() - write length continuation bytes
+ *
+ * @op:   output position
+ * @oend: end of output buffer
+ * @len:  length minus LZ_RUN_MASK
+ *
+ * Return: new output position, or NULL if output does not fit
+ */
+static uint8_t *put_length(uint8_t *op, uint8_t *oend, size_t len)
+{
+	for (; len >= 255; len -= 255) {
+		if (op >= oend)
+			return NULL;
+		*op++ = 255;
+	}
+
+	if (op >= oend)
+		return NULL;
+	*op++ = len;
+
+	return op;
+}
+
+/**
+ * put_sequence() - write a sequence
+ *
+ * @op:      output position
+ * @oend:    end of output buffer
+ * @lit:     literal bytes
+ * @lit_len: number of literal bytes
+ * @offset:  match offset, or zero for the last sequence
+ * @len:     match length
+ *
+ * Return: new output position, or NULL if output does not fit
+ */
+static uint8_t *put_sequence(uint8_t *op, uint8_t *oend, const uint8_t *lit,
+			     size_t lit_len, size_t offset, size_t len)
+{
+	uint8_t *token;
+
+	if (op >= oend)
+		return NULL;
+
+	token = op++;
+	*token = (lit_len < LZ_RUN_MASK ? lit_len : LZ_RUN_MASK) << 4;
+	if (lit_len >= LZ_RUN_MASK) {
+		op = put_length(op, oend, lit_len - LZ_RUN_MASK);
+		if (op == NULL)
+			return NULL;
+	}
+
+	if ((size_t) (oend - op) < lit_len)
+		return NULL;
+	memcpy(op, lit, lit_len);
+	op += lit_len;
+
+	if (offset == 0)
+		return op;
+
+	if (oend - op < 2)
+		return NULL;
+	*op++ = offset & 0xff;
+	*op++ = offset >> 8;
+
+	len -= LZ_MIN_MATCH;
+	*token |= len < LZ_RUN_MASK ? len : LZ_RUN_MASK;
+	if (len >= LZ_RUN_MASK)
+		op = put_length(op, oend, len - LZ_RUN_MASK);
+
+	return op;
+}
+
+/**
+ * lz_compress() - compress a buffer
+ *
+ * Matches are found through a single entry hash table of recently seen
+ * positions, trading ratio for speed.
+ *
+ * @src:      data to compress
+ * @size:     size of data to compress
+ * @dst:      output buffer
+ * @capacity: size of output buffer
+ *
+ * Return: compressed size, or zero if it exceeds capacity
+ */
+size_t lz_compress(const void *src, size_t size, void *dst, size_t capacity)
+{
+	const uint8_t *in = src, *end = in + size, *anchor = in, *ip = in;
+	uint8_t *op = dst, *oend = op + capacity;
+	uint32_t table[1 << LZ_HASH_BITS];
+	const uint8_t *match;
+	size_t len;
+	unsigned h;
+
+	assert(src != NULL || size == 0);
+	assert(dst != NULL);
+
+	memset(table, 0, sizeof(table));
+
+	while (end - ip >= LZ_MIN_MATCH) {
+		h = hash(read32(ip));
+		match = in + table[h];
+		table[h] = ip - in;
+
+		if (match >= ip || ip - match > LZ_MAX_OFFSET ||
+		    read32(match) != read32(ip)) {
+			ip++;
+			continue;
+		}
+
+		for (len = LZ_MIN_MATCH;
+		     ip + len < end && match[len] == ip[len]; len++)
+			/* NOTHING */;
+
+		op = put_sequence(op, oend, anchor, ip - anchor,
+				  ip - match, len);
+		if (op == NULL)
+			return 0;
+
+		ip += len;
+		anchor = ip;
+	}
+
+	op = put_sequence(op, oend, anchor, end - anchor, 0, 0);
+	if (op == NULL)
+		return 0;
+
+	return op - (uint8_t *) dst;
+}
+
+/**
+ * get_length() - read length continuation bytes
+ *
+ * @ip:   input position, advanced past continuation bytes
+ * @iend: end of input
+ * @len:  length to add continuation to
+ *
+ * Return: zero on success, or -1 if input is truncated
+ */
+static int get_length(const uint8_t **ip, const uint8_t *iend, size_t *len)
+{
+	uint8_t b;
+
+	do {
+		if (*ip >= iend)
+			return -1;
+		b = *(*ip)++;
+		*len += b;
+	} while (b == 255);
+
+	return 0;
+}
+
+/**
+ * lz_decompress() - decompress a buffer compressed by lz_compress()
+ *
+ * Malformed input is detected rather than trusted, so that no byte outside
+ * of both buffers is accessed.
+ *
+ * @src:      compressed data
+ * @size:     size of compressed data
+ * @dst:      output buffer
+ * @capacity: size of output buffer
+ *
+ * Return: decompressed size, or -1 if input is malformed or does not fit
+ */
+ssize_t lz_decompress(const void *src, size_t size, void *dst, size_t capacity)
+{
+	const uint8_t *ip = src, *iend = ip + size;
+	uint8_t *op = dst, *oend = op + capacity;
+	size_t lit_len, len, offset;
+	const uint8_t *match;
+	uint8_t token;
+
+	assert(src != NULL || size == 0);
+	assert(dst != NULL);
+
+	while (ip < iend) {
+		token = *ip++;
+
+		lit_len = token >> 4;
+		if (lit_len == LZ_RUN_MASK &&
+		    get_length(&ip, iend, &lit_len) != 0)
+			return -1;
+
+		if ((size_t) (iend - ip) < lit_len ||
+		    (size_t) (oend - op) < lit_len)
+			return -1;
+		memcpy(op, ip, lit_len);
+		ip += lit_len;
+		op += lit_len;
+
+		/* Last sequence has no match */
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		offset = ip[0] | ip[1] << 8;
+		ip += 2;
+
+		len = token & LZ_RUN_MASK;
+		if (len == LZ_RUN_MASK && get_length(&ip, iend, &len) != 0)
+			return -1;
+		len += LZ_MIN_MATCH;
+
+		if (offset == 0 || offset > (size_t) (op - (uint8_t *) dst) ||
+		    (size_t) (oend - op) < len)
+			return -1;
+
+		/* Overlapping matches repeat the last offset bytes */
+		match = op - offset;
+		if (offset >= len) {
+			memcpy(op, match, len);
+			op += len;
+		} else {
+			while (len-- > 0)
+				*op++ = *match++;
+		}
+	}
+
+	return op - (uint8_t *) dst;
+}
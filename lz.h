@@ -0,0 +1,10 @@
+#ifndef _LZ_H
+#define _LZ_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+size_t lz_compress(const void *, size_t, void *, size_t);
+ssize_t lz_decompress(const void *, size_t, void *, size_t);
+
+#endif /* _LZ_H */
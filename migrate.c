@@ -0,0 +1,969 @@
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/user.h>
+#include <unistd.h>
+
+#include <linux/kvm.h>
+
+#include "bulk.h"
+#include "kvm.h"
+#include "kvmapp.h"
+#include "log.h"
+#include "migrate.h"
+#include "vcpu.h"
+
+/**
+ * MIGRATE_MAGIC - migration stream signature
+ */
+#define MIGRATE_MAGIC "KVMMIGR1"
+
+/**
+ * MIGRATE_SIGNAL - signal that starts an armed migration
+ */
+#define MIGRATE_SIGNAL SIGUSR2
+
+/**
+ * enum
+ *
+ * @MAX_ROUNDS:      maximum number of pre-copy rounds while the guest runs
+ * @MAX_FINAL_PAGES: number of dirty pages small enough to be copied while
+ *                   the guest is paused
+ * @KICK_INTERVAL:   interval between attempts to pause a virtual CPU, in
+ *                   nanoseconds
+ */
+enum {
+	MAX_ROUNDS      = 30,
+	MAX_FINAL_PAGES = 256,
+	KICK_INTERVAL   = 10000000,
+};
+
+/**
+ * enum - migration stream message types
+ *
+ * @MSG_MEMSLOT: memory region layout, @arg is guest physical address and
+ *               @count is size in pages
+ * @MSG_PAGES:   @count pages starting at guest physical address @arg,
+ *               followed by page contents
+ * @MSG_REGS:    general purpose registers of virtual CPU @arg, followed by
+ *               @count bytes of struct kvm_regs
+ * @MSG_SREGS:   special registers of virtual CPU @arg, followed by @count
+ *               bytes of struct kvm_sregs
+ * @MSG_XCRS:    extended control registers of virtual CPU @arg, followed by
+ *               @count bytes of struct kvm_xcrs
+ * @MSG_XSAVE:   extended processor state of virtual CPU @arg, followed by
+ *               @count bytes of struct kvm_xsave
+ * @MSG_MSR:     model specific register @count of virtual CPU @arg,
+ *               followed by its 64-bit value
+ * @MSG_CLOCK:   guest clock, @arg is its value in nanoseconds
+ * @MSG_END:     end of the stream, target resumes the guest
+ */
+enum {
+	MSG_MEMSLOT = 1,
+	MSG_PAGES,
+	MSG_REGS,
+	MSG_SREGS,
+	MSG_XCRS,
+	MSG_XSAVE,
+	MSG_MSR,
+	MSG_CLOCK,
+	MSG_END,
+};
+
+/**
+ * enum - migration states
+ *
+ * @STATE_IDLE:    waiting for MIGRATE_SIGNAL
+ * @STATE_PRECOPY: copying memory while the guest runs
+ * @STATE_PAUSE:   virtual CPU is requested to pause
+ * @STATE_PAUSED:  virtual CPU is paused, final state is being sent
+ * @STATE_DONE:    target took over the guest
+ * @STATE_FAILED:  migration failed, guest continues on the source
+ */
+enum {
+	STATE_IDLE,
+	STATE_PRECOPY,
+	STATE_PAUSE,
+	STATE_PAUSED,
+	STATE_DONE,
+	STATE_FAILED,
+};
+
+/**
+ * enum - parts of virtual CPU state received from a migration stream
+ *
+ * @PART_REGS:  general purpose registers
+ * @PART_SREGS: special registers
+ * @PART_XCRS:  extended control registers
+ * @PART_XSAVE: extended processor state
+ * @PART_MSR:   first of vcpu_msrs, the others following in order
+ * @PART_ALL:   complete virtual CPU state
+ */
+enum {
+	PART_REGS  = 1 << 0,
+	PART_SREGS = 1 << 1,
+	PART_XCRS  = 1 << 2,
+	PART_XSAVE = 1 << 3,
+	PART_MSR   = 1 << 4,
+	PART_ALL   = (PART_MSR << VCPU_NUM_MSRS) - 1,
+};
+
+/**
+ * struct msg - migration stream message header
+ *
+ * @type:  MSG_* message type
+ * @count: type specific count
+ * @arg:   type specific argument
+ */
+struct msg {
+	uint32_t type;
+	uint32_t count;
+	uint64_t arg;
+};
+
+/**
+ * struct migration - outgoing migration
+ *
+ * @vm:         migrated virtual machine
+ * @path:       target socket path
+ * @fd:         socket connected to the target, or -1
+ * @thread:     migration thread
+ * @lock:       protects @state
+ * @cond:       signalled on @state change
+ * @state:      STATE_* migration state
+ * @cancelled:  non-zero once the guest stopped running on the source
+ * @bitmap:     dirty page bitmaps, one per memory region
+ * @num_bytes:  number of bytes sent
+ * @num_rounds: number of pre-copy rounds
+ * @start_ns:   migration start time
+ * @pause_ns:   time the guest was requested to pause
+ * @end_ns:     time the target took over
+ */
+struct migration {
+	struct vm *vm;
+	const char *path;
+	int fd;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int state;
+	int cancelled;
+	uint64_t *bitmap[MAX_MEMSLOTS];
+	uint64_t num_bytes;
+	unsigned num_rounds;
+	uint64_t start_ns;
+	uint64_t pause_ns;
+	uint64_t end_ns;
+};
+
+/*
+ * Posted by MIGRATE_SIGNAL handler to start a migration
+ */
+static sem_t trigger;
+
+/**
+ * trigger_handler() - start an armed migration
+ *
+ * @sig: signal number
+ */
+static void trigger_handler(int sig)
+{
+	(void) sig;
+
+	sem_post(&trigger);
+}
+
+/**
+ * monotonic_ns() - read monotonic clock
+ *
+ * Return: monotonic time in nanoseconds
+ */
+static uint64_t monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * send_all() - send a buffer over a migration socket
+ *
+ * @m:    outgoing migration
+ * @buf:  data to send
+ * @size: size of data in bytes
+ *
+ * Return: zero on success, or -1 if an error occurred
+ */
+static int send_all(struct migration *m, const void *buf, size_t size)
+{
+	ssize_t n;
+
+	for (/* NOTHING */; size > 0; size -= n, buf = (const char *) buf + n) {
+		n = send(m->fd, buf, size, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			n = 0;
+		else if (n <= 0) {
+			error("%s", m->path);
+			return -1;
+		}
+		m->num_bytes += n;
+	}
+
+	return 0;
+}
+
+/**
+ * recv_all() - receive a buffer from a migration socket
+ *
+ * @fd:   connected socket
+ * @buf:  where to store received data
+ * @size: size of data in bytes
+ *
+ * Return: zero on success, or -1 if an error occurred
+ */
+static int recv_all(int fd, void *buf, size_t size)
+{
+	ssize_t n;
+
+	for (/* NOTHING */; size > 0; size -= n, buf = (char *) buf + n) {
+		n = recv(fd, buf, size, MSG_WAITALL);
+		if (n < 0 && errno == EINTR)
+			n = 0;
+		else if (n < 0) {
+			error("failed to receive migration stream");
+			return -1;
+		} else if (n == 0) {
+			errorx("migration stream ended prematurely");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * send_msg() - send a migration stream message with an optional payload
+ *
+ * @m:     outgoing migration
+ * @type:  MSG_* message type
+ * @count: type specific count
+ * @arg:   type specific argument
+ * @data:  payload, or NULL
+ * @size:  payload size in bytes
+ *
+ * Return: zero on success, or -1 if an error occurred
+ */
+static int send_msg(struct migration *m, uint32_t type, uint32_t count,
+		    uint64_t arg, const void *data, size_t size)
+{
+	struct msg msg = { type, count, arg };
+
+	if (send_all(m, &msg, sizeof(msg)) != 0)
+		return -1;
+
+	return data != NULL ? send_all(m, data, size) : 0;
+}
+
+/**
+ * send_pages() - send runs of selected pages of a memory region
+ *
+ * @m:      outgoing migration
+ * @slot:   memory region
+ * @bitmap: dirty page bitmap, or NULL to send all non-zero pages
+ *
+ * Return: number of sent pages, or -1 if an error occurred
+ */
+static ssize_t send_pages(struct migration *m,
+			  const struct kvm_userspace_memory_region *slot,
+			  const uint64_t *bitmap)
+{
+	size_t num_pages = slot->memory_size / PAGE_SIZE;
+	const uint8_t *hva = (const void *) (uintptr_t) slot->userspace_addr;
+	size_t i, run, sent = 0;
+
+	for (i = 0; i < num_pages; i += run) {
+		for (run = 0; i + run < num_pages; run++) {
+			size_t p = i + run;
+
+			if (bitmap != NULL ?
+			    (bitmap[p / 64] & (1ULL << (p % 64))) == 0 :
+			    bulk_is_zero(hva + p * PAGE_SIZE, PAGE_SIZE))
+				break;
+		}
+
+		if (run == 0) {
+			run = 1;
+			continue;
+		}
+
+		if (send_msg(m, MSG_PAGES, run,
+			     slot->guest_phys_addr + i * PAGE_SIZE,
+			     hva + i * PAGE_SIZE, run * PAGE_SIZE) != 0)
+			return -1;
+
+		sent += run;
+	}
+
+	return sent;
+}
+
+/**
+ * send_dirty() - send pages dirtied since the previous call
+ *
+ * @m: outgoing migration
+ *
+ * Return: number of sent pages, or -1 if an error occurred
+ */
+static ssize_t send_dirty(struct migration *m)
+{
+	const struct kvm_userspace_memory_region *slot;
+	ssize_t n, total = 0;
+	unsigned i;
+
+	for (i = 0; (slot = vm_get_memslot(m->vm, i)) != NULL; i++) {
+		if (vm_get_dirty_log(m->vm, i, m->bitmap[i]) != 0)
+			return -1;
+
+		n = send_pages(m, slot, m->bitmap[i]);
+		if (n < 0)
+			return -1;
+		total += n;
+	}
+
+	return total;
+}
+
+/**
+ * send_vcpu_state() - send register state of all virtual CPUs and guest
+ *                     clock
+ *
+ * @m: outgoing migration with paused virtual CPUs
+ *
+ * Return: zero on success, or -1 if an error occurred
+ */
+static int send_vcpu_state(struct migration *m)
+{
+	struct vcpu_snapshot snap;
+	uint64_t value;
+	unsigned i, j;
+
+	for (i = 0; i < vm_get_num_vcpus(m->vm); i++) {
+		if (vcpu_save(m->vm, i, &snap) != 0)
+			return -1;
+
+		if (send_msg(m, MSG_REGS, sizeof(snap.regs), i,
+			     &snap.regs, sizeof(snap.regs)) != 0 ||
+		    send_msg(m, MSG_SREGS, sizeof(snap.sregs), i,
+			     &snap.sregs, sizeof(snap.sregs)) != 0 ||
+		    send_msg(m, MSG_XCRS, sizeof(snap.xcrs), i,
+			     &snap.xcrs, sizeof(snap.xcrs)) != 0 ||
+		    send_msg(m, MSG_XSAVE, sizeof(snap.xsave), i,
+			     &snap.xsave, sizeof(snap.xsave)) != 0)
+			return -1;
+
+		for (j = 0; j < VCPU_NUM_MSRS; j++)
+			if (send_msg(m, MSG_MSR, vcpu_msrs[j], i,
+				     &snap.msr[j], sizeof(snap.msr[j])) != 0)
+				return -1;
+	}
+
+	/* Guest time stands still between pause and resume */
+	if (vm_get_clock(m->vm, &value) != 0 ||
+	    send_msg(m, MSG_CLOCK, 0, value, NULL, 0) != 0)
+		return -1;
+
+	return 0;
+}
+
+/**
+ * set_state() - change migration state and wake up waiters
+ *
+ * @m:     outgoing migration
+ * @state: STATE_* migration state
+ */
+static void set_state(struct migration *m, int state)
+{
+	pthread_mutex_lock(&m->lock);
+	__atomic_store_n(&m->state, state, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&m->cond);
+	pthread_mutex_unlock(&m->lock);
+}
+
+/**
+ * pause_guest() - stop all virtual CPUs at their next KVM_EXIT_INTR exit
+ *
+ * Pausing on KVM_EXIT_INTR guarantees that KVM completed any pending port
+ * or MMIO read, so register state is consistent.
+ *
+ * @m: outgoing migration
+ *
+ * Return: zero on success, or -1 if the guest stopped running meanwhile
+ */
+static int pause_guest(struct migration *m)
+{
+	struct timespec deadline;
+	unsigned i;
+	int ret = 0;
+
+	pthread_mutex_lock(&m->lock);
+	m->pause_ns = monotonic_ns();
+	__atomic_store_n(&m->state, STATE_PAUSE, __ATOMIC_RELEASE);
+
+	while (m->state != STATE_PAUSED) {
+		if (__atomic_load_n(&m->cancelled, __ATOMIC_ACQUIRE)) {
+			ret = -1;
+			break;
+		}
+
+		/* Kicks are lost if they race with an exit, so repeat them */
+		for (i = 0; i < vm_get_num_vcpus(m->vm); i++)
+			vcpu_kick(m->vm, i);
+
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += KICK_INTERVAL;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&m->cond, &m->lock, &deadline);
+	}
+
+	pthread_mutex_unlock(&m->lock);
+
+	return ret;
+}
+
+/**
+ * connect_socket() - connect to a UNIX stream socket
+ *
+ * @path: socket path
+ *
+ * Return: connected socket, or -1 if an error occurred
+ */
+static int connect_socket(const char *path)
+{
+	struct sockaddr_un sun;
+	int fd;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		errorx("%s: socket path too long", path);
+		return -1;
+	}
+	strcpy(sun.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *) &sun, sizeof(sun)) != 0) {
+		error("%s", path);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/**
+ * migrate() - transfer a running guest to the target
+ *
+ * @m: outgoing migration
+ *
+ * Return: zero on success, or -1 if an error occurred
+ */
+static int migrate(struct migration *m)
+{
+	const struct kvm_userspace_memory_region *slot;
+	ssize_t dirty = -1;
+	unsigned i;
+	char ack;
+
+	m->fd = connect_socket(m->path);
+	if (m->fd < 0)
+		return -1;
+
+	if (send_all(m, MIGRATE_MAGIC, sizeof(MIGRATE_MAGIC) - 1) != 0)
+		return -1;
+
+	for (i = 0; (slot = vm_get_memslot(m->vm, i)) != NULL; i++)
+		if (send_msg(m, MSG_MEMSLOT, slot->memory_size / PAGE_SIZE,
+			     slot->guest_phys_addr, NULL, 0) != 0)
+			return -1;
+
+	/* Pages written after logging starts are sent again later */
+	for (i = 0; (slot = vm_get_memslot(m->vm, i)) != NULL; i++)
+		if (vm_set_dirty_log(m->vm, i, 1) != 0 ||
+		    send_pages(m, slot, NULL) < 0)
+			return -1;
+
+	for (m->num_rounds = 1; m->num_rounds < MAX_ROUNDS; m->num_rounds++) {
+		if (__atomic_load_n(&m->cancelled, __ATOMIC_ACQUIRE))
+			return -1;
+
+		dirty = send_dirty(m);
+		if (dirty < 0)
+			return -1;
+		if (dirty <= MAX_FINAL_PAGES)
+			break;
+	}
+
+	if (pause_guest(m) != 0) {
+		errorx("%s: guest stopped before migration completed",
+		       m->path);
+		return -1;
+	}
+
+	if (send_dirty(m) < 0 || send_vcpu_state(m) != 0 ||
+	    send_msg(m, MSG_END, 0, 0, NULL, 0) != 0)
+		return -1;
+
+	if (recv_all(m->fd, &ack, sizeof(ack)) != 0)
+		return -1;
+
+	m->end_ns = monotonic_ns();
+
+	return 0;
+}
+
+/**
+ * migration_thread() - wait for MIGRATE_SIGNAL, run a migration and publish
+ *                      its outcome
+ *
+ * @arg: outgoing migration
+ *
+ * Return: NULL
+ */
+static void *migration_thread(void *arg)
+{
+	const struct kvm_userspace_memory_region *slot;
+	struct migration *m = arg;
+	unsigned i;
+
+	while (sem_wait(&trigger) != 0)
+		/* NOTHING */;
+
+	if (__atomic_load_n(&m->cancelled, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	m->start_ns = monotonic_ns();
+	set_state(m, STATE_PRECOPY);
+
+	if (migrate(m) == 0) {
+		set_state(m, STATE_DONE);
+		return NULL;
+	}
+
+	for (i = 0; (slot = vm_get_memslot(m->vm, i)) != NULL; i++)
+		if ((slot->flags & KVM_MEM_LOG_DIRTY_PAGES) != 0)
+			vm_set_dirty_log(m->vm, i, 0);
+
+	set_state(m, STATE_FAILED);
+
+	return NULL;
+}
+
+/**
+ * migrate_start() - arm moving a virtual machine to another process on
+ *                   MIGRATE_SIGNAL
+ *
+ * Memory is copied while the guest keeps running, repeating for pages
+ * dirtied meanwhile, until few enough remain to be copied with the guest
+ * paused. The virtual CPU thread has to call migrate_poll() on every
+ * KVM_EXIT_INTR exit.
+ *
+ * @vm:   virtual machine to migrate
+ * @path: UNIX socket path the target process listens on
+ *
+ * Return: outgoing migration, or NULL if an error occurred
+ */
+struct migration *migrate_start(struct vm *vm, const char *path)
+{
+	const struct kvm_userspace_memory_region *slot;
+	struct migration *m;
+	struct sigaction sa;
+	unsigned i;
+
+	assert(vm != NULL);
+	assert(path != NULL);
+
+	m = calloc(1, sizeof(*m));
+	if (m == NULL) {
+		error("failed to allocate migration");
+		return NULL;
+	}
+
+	m->vm = vm;
+	m->path = path;
+	m->fd = -1;
+	m->state = STATE_IDLE;
+	pthread_mutex_init(&m->lock, NULL);
+	pthread_cond_init(&m->cond, NULL);
+
+	for (i = 0; (slot = vm_get_memslot(vm, i)) != NULL; i++) {
+		m->bitmap[i] = calloc(round_up(slot->memory_size / PAGE_SIZE,
+					       64) / 8, 1);
+		if (m->bitmap[i] == NULL) {
+			error("failed to allocate dirty page bitmap");
+			goto err;
+		}
+	}
+
+	sem_init(&trigger, 0, 0);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = trigger_handler;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART;
+	if (sigaction(MIGRATE_SIGNAL, &sa, NULL) != 0) {
+		error("failed to install migration signal handler");
+		goto err;
+	}
+
+	if (pthread_create(&m->thread, NULL, migration_thread, m) == 0)
+		return m;
+
+	errorx("failed to start migration thread");
+	signal(MIGRATE_SIGNAL, SIG_DFL);
+
+err:
+	for (i = 0; i < MAX_MEMSLOTS; i++)
+		free(m->bitmap[i]);
+	free(m);
+
+	return NULL;
+}
+
+/**
+ * migrate_poll() - pause a virtual CPU if migration asks for it
+ *
+ * Called by the virtual CPU thread on KVM_EXIT_INTR exits. Blocks while
+ * the final state is sent.
+ *
+ * @m:    outgoing migration
+ * @vcpu: virtual CPU identifier
+ *
+ * Return: non-zero if the guest moved to the target and must not be run
+ *         anymore, or zero to keep running it
+ */
+int migrate_poll(struct migration *m, unsigned vcpu)
+{
+	int state;
+
+	assert(m != NULL);
+	(void) vcpu;
+
+	state = __atomic_load_n(&m->state, __ATOMIC_ACQUIRE);
+	if (state == STATE_IDLE || state == STATE_PRECOPY ||
+	    state == STATE_FAILED)
+		return 0;
+
+	pthread_mutex_lock(&m->lock);
+	if (m->state == STATE_PAUSE) {
+		m->state = STATE_PAUSED;
+		pthread_cond_broadcast(&m->cond);
+	}
+	while (m->state == STATE_PAUSED)
+		pthread_cond_wait(&m->cond, &m->lock);
+	state = m->state;
+	pthread_mutex_unlock(&m->lock);
+
+	return state == STATE_DONE;
+}
+
+/**
+ * migrate_finish() - wait for a migration to end and report its cost
+ *
+ * Must be called once virtual CPUs stopped running.
+ *
+ * @m: outgoing migration
+ *
+ * Return: zero if the target took over the guest or migration was never
+ *         started, or -1 otherwise
+ */
+int migrate_finish(struct migration *m)
+{
+	unsigned i;
+	int ret;
+
+	assert(m != NULL);
+
+	__atomic_store_n(&m->cancelled, 1, __ATOMIC_RELEASE);
+	sem_post(&trigger);
+	pthread_mutex_lock(&m->lock);
+	pthread_cond_broadcast(&m->cond);
+	pthread_mutex_unlock(&m->lock);
+
+	pthread_join(m->thread, NULL);
+	signal(MIGRATE_SIGNAL, SIG_DFL);
+
+	ret = m->state == STATE_DONE || m->state == STATE_IDLE ? 0 : -1;
+	if (m->state == STATE_DONE)
+		fprintf(stderr, "migrate: %u rounds, %.2f MiB sent in "
+			"%.3f ms, downtime %.3f ms\n", m->num_rounds,
+			m->num_bytes / 1048576.0,
+			(m->end_ns - m->start_ns) / 1e6,
+			(m->end_ns - m->pause_ns) / 1e6);
+
+	if (m->fd >= 0)
+		close(m->fd);
+	sem_destroy(&trigger);
+	pthread_cond_destroy(&m->cond);
+	pthread_mutex_destroy(&m->lock);
+	for (i = 0; i < MAX_MEMSLOTS; i++)
+		free(m->bitmap[i]);
+	free(m);
+
+	return ret;
+}
+
+/**
+ * accept_socket() - wait for a single connection on a UNIX stream socket
+ *
+ * @path: socket path, replaced if it exists
+ *
+ * Return: connected socket, or -1 if an error occurred
+ */
+static int accept_socket(const char *path)
+{
+	struct sockaddr_un sun;
+	int fd, conn = -1;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		errorx("%s: socket path too long", path);
+		return -1;
+	}
+	strcpy(sun.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		error("%s", path);
+		return -1;
+	}
+
+	unlink(path);
+	if (bind(fd, (struct sockaddr *) &sun, sizeof(sun)) == 0 &&
+	    listen(fd, 1) == 0)
+		conn = accept(fd, NULL, NULL);
+
+	if (conn < 0)
+		error("%s", path);
+
+	unlink(path);
+	close(fd);
+
+	return conn;
+}
+
+/**
+ * recv_vcpu_part() - receive part of virtual CPU state from a migration
+ *                    stream
+ *
+ * @fd:    connected socket
+ * @msg:   MSG_REGS, MSG_SREGS, MSG_XCRS, MSG_XSAVE or MSG_MSR message
+ * @snap:  where to store virtual CPU state
+ * @parts: PART_* bits of virtual CPU state received so far
+ *
+ * Return: zero on success, or -1 if an error occurred
+ */
+static int recv_vcpu_part(int fd, const struct msg *msg,
+			  struct vcpu_snapshot *snap, unsigned *parts)
+{
+	unsigned part, i;
+	size_t size;
+	void *buf;
+
+	switch (msg->type) {
+	case MSG_REGS:
+		buf = &snap->regs;
+		size = sizeof(snap->regs);
+		part = PART_REGS;
+		break;
+
+	case MSG_SREGS:
+		buf = &snap->sregs;
+		size = sizeof(snap->sregs);
+		part = PART_SREGS;
+		break;
+
+	case MSG_XCRS:
+		buf = &snap->xcrs;
+		size = sizeof(snap->xcrs);
+		part = PART_XCRS;
+		break;
+
+	case MSG_XSAVE:
+		buf = &snap->xsave;
+		size = sizeof(snap->xsave);
+		part = PART_XSAVE;
+		break;
+
+	default:
+		assert(msg->type == MSG_MSR);
+		for (i = 0; i < VCPU_NUM_MSRS; i++)
+			if (vcpu_msrs[i] == msg->count)
+				break;
+		if (i == VCPU_NUM_MSRS)
+			return -1;
+
+		buf = &snap->msr[i];
+		size = sizeof(snap->msr[i]);
+		part = PART_MSR << i;
+		break;
+	}
+
+	/* Register sets carry their size in @count, MSRs their index */
+	if ((msg->type != MSG_MSR && msg->count != size) ||
+	    recv_all(fd, buf, size) != 0)
+		return -1;
+
+	*parts |= part;
+
+	return 0;
+}
+
+/**
+ * receive() - load guest state from a migration stream
+ *
+ * @vm: virtual machine with the same memory layout as the source
+ * @fd: connected socket
+ *
+ * Return: zero on success, or -1 if an error occurred
+ */
+static int receive(struct vm *vm, int fd)
+{
+	const struct kvm_userspace_memory_region *slot;
+	struct vcpu_snapshot vcpu[MAX_VCPUS];
+	unsigned parts[MAX_VCPUS] = { 0 };
+	struct iovec iov[MAX_MEMSLOTS];
+	char magic[sizeof(MIGRATE_MAGIC) - 1];
+	unsigned num_slots = 0, v;
+	int has_clock = 0;
+	struct msg msg;
+	uint64_t clock;
+	int i, n;
+
+	if (recv_all(fd, magic, sizeof(magic)) != 0)
+		return -1;
+
+	if (memcmp(magic, MIGRATE_MAGIC, sizeof(magic)) != 0) {
+		errorx("not a migration stream");
+		return -1;
+	}
+
+	for (;;) {
+		if (recv_all(fd, &msg, sizeof(msg)) != 0)
+			return -1;
+
+		switch (msg.type) {
+		case MSG_MEMSLOT:
+			slot = vm_get_memslot(vm, num_slots++);
+			if (slot == NULL || slot->guest_phys_addr != msg.arg ||
+			    slot->memory_size != msg.count * PAGE_SIZE) {
+				errorx("memory layout differs from source, "
+				       "region 0x%" PRIx64 " of %" PRIu64
+				       " MiB", msg.arg,
+				       (uint64_t) msg.count * PAGE_SIZE >> 20);
+				return -1;
+			}
+			break;
+
+		case MSG_PAGES:
+			n = vm_guest_iov(vm, msg.arg,
+					 (size_t) msg.count * PAGE_SIZE,
+					 iov, MAX_MEMSLOTS);
+			if (n < 0)
+				return -1;
+			for (i = 0; i < n; i++)
+				if (recv_all(fd, iov[i].iov_base,
+					     iov[i].iov_len) != 0)
+					return -1;
+			break;
+
+		case MSG_REGS:
+		case MSG_SREGS:
+		case MSG_XCRS:
+		case MSG_XSAVE:
+		case MSG_MSR:
+			if (msg.arg >= vm_get_num_vcpus(vm) ||
+			    recv_vcpu_part(fd, &msg, &vcpu[msg.arg],
+					   &parts[msg.arg]) != 0)
+				goto bad_vcpu;
+			break;
+
+		case MSG_CLOCK:
+			clock = msg.arg;
+			has_clock = 1;
+			break;
+
+		case MSG_END:
+			for (v = 0; v < vm_get_num_vcpus(vm); v++)
+				if (parts[v] != PART_ALL ||
+				    vcpu_load(vm, v, &vcpu[v]) != 0) {
+					errorx("failed to load VCPU #%u state",
+					       v);
+					return -1;
+				}
+
+			/* Time stood still since the source paused */
+			if (has_clock && vm_set_clock(vm, clock) != 0)
+				return -1;
+
+			return 0;
+
+		default:
+			errorx("unknown migration message type %u", msg.type);
+			return -1;
+		}
+	}
+
+bad_vcpu:
+	errorx("failed to receive VCPU #%" PRIu64 " state", msg.arg);
+	return -1;
+}
+
+/**
+ * migrate_receive() - take over a virtual machine from another process
+ *
+ * @vm:   freshly created virtual machine with the same memory layout as
+ *        the migrated one
+ * @path: UNIX socket path to listen on
+ *
+ * Return: zero on success, or -1 if an error occurred
+ */
+int migrate_receive(struct vm *vm, const char *path)
+{
+	const char ack = 0;
+	int fd, ret;
+
+	assert(vm != NULL);
+	assert(path != NULL);
+
+	fd = accept_socket(path);
+	if (fd < 0)
+		return -1;
+
+	ret = receive(vm, fd);
+	if (ret == 0 && send(fd, &ack, sizeof(ack), MSG_NOSIGNAL) != 1) {
+		error("%s", path);
+		ret = -1;
+	}
+
+	close(fd);
+
+	return ret;
+}
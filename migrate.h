@@ -0,0 +1,12 @@
+#ifndef _MIGRATE_H
+#define _MIGRATE_H
+
+struct migration;
+struct vm;
+
+struct migration *migrate_start(struct vm *, const char *);
+int migrate_poll(struct migration *, unsigned);
+int migrate_finish(struct migration *);
+int migrate_receive(struct vm *, const char *);
+
+#endif /* _MIGRATE_H */
@@ -0,0 +1,198 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/user.h>
+
+#include <linux/kvm.h>
+
+#include "kvm.h"
+#include "kvmapp.h"
+#include "log.h"
+#include "prealloc.h"
+
+#ifndef MADV_POPULATE_WRITE
+# define MADV_POPULATE_WRITE 23
+#endif /* MADV_POPULATE_WRITE */
+
+/**
+ * enum
+ *
+ * @MAX_THREADS: maximum number of populating threads
+ * @CHUNK_SIZE:  granularity of work split, a huge page multiple
+ */
+enum {
+	MAX_THREADS = 64,
+	CHUNK_SIZE  = 2 << 20,
+};
+
+/**
+ * struct worker - populating thread
+ *
+ * @vm:     virtual machine descriptor
+ * @start:  offset of the first byte to populate, counting all memory slots
+ *          back to back
+ * @end:    offset past the last byte to populate
+ * @thread: thread handle
+ * @ret:    zero on success, or -1 if populating failed
+ */
+struct worker {
+	struct vm *vm;
+	size_t start;
+	size_t end;
+	pthread_t thread;
+	int ret;
+};
+
+/**
+ * populate() - fault in host memory backing a range
+ *
+ * MADV_POPULATE_WRITE faults in all pages with a single system call. On
+ * kernels lacking it, every page is written by hand, keeping its contents.
+ *
+ * @addr: start of the range, page aligned
+ * @size: range size
+ *
+ * Return: zero on success, or -1 if an error occurred
+ */
+static int populate(void *addr, size_t size)
+{
+	volatile uint8_t *p;
+
+	if (madvise(addr, size, MADV_POPULATE_WRITE) == 0)
+		return 0;
+
+	if (errno != EINVAL)
+		return -1;
+
+	for (p = addr; p < (uint8_t *) addr + size; p += PAGE_SIZE)
+		*p = *p;
+
+	return 0;
+}
+
+/**
+ * worker_thread() - populate memory slot parts overlapping a worker range
+ *
+ * @arg: worker
+ *
+ * Return: NULL
+ */
+static void *worker_thread(void *arg)
+{
+	const struct kvm_userspace_memory_region *m;
+	struct worker *w = arg;
+	size_t base = 0, from, to;
+	unsigned slot;
+
+	for (slot = 0; (m = vm_get_memslot(w->vm, slot)) != NULL; slot++) {
+		from = base > w->start ? base : w->start;
+		to = base + m->memory_size < w->end ?
+		    base + m->memory_size : w->end;
+
+		if (from < to &&
+		    populate((void *) (uintptr_t) m->userspace_addr +
+			     (from - base), to - from) != 0) {
+			error("failed to populate memory slot #%u", slot);
+			w->ret = -1;
+			break;
+		}
+
+		base += m->memory_size;
+	}
+
+	return NULL;
+}
+
+/**
+ * elapsed_ns() - get time passed since a given moment
+ *
+ * @since: moment on CLOCK_MONOTONIC
+ *
+ * Return: elapsed time in nanoseconds
+ */
+static double elapsed_ns(const struct timespec *since)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - since->tv_sec) * 1e9 +
+	    (now.tv_nsec - since->tv_nsec);
+}
+
+/**
+ * prealloc_memory() - fault in host memory of all memory slots of a virtual
+ *                     machine, so that the guest does not take host page
+ *                     faults on first touch
+ *
+ * Memory is split into disjoint ranges, each populated by its own thread.
+ *
+ * @vm:          virtual machine descriptor
+ * @num_threads: number of populating threads
+ * @report:      non-zero to report populating throughput on stderr
+ *
+ * Return: zero on success, or -1 if an error occurred
+ */
+int prealloc_memory(struct vm *vm, unsigned num_threads, int report)
+{
+	const struct kvm_userspace_memory_region *m;
+	struct worker worker[MAX_THREADS];
+	size_t total = 0, chunks;
+	struct timespec start;
+	unsigned i, started;
+	double ns;
+	int ret = 0;
+
+	assert(vm != NULL);
+	assert(num_threads > 0);
+
+	for (i = 0; (m = vm_get_memslot(vm, i)) != NULL; i++)
+		total += m->memory_size;
+
+	chunks = round_up(total, (size_t) CHUNK_SIZE) / CHUNK_SIZE;
+	if (num_threads > MAX_THREADS)
+		num_threads = MAX_THREADS;
+	if (num_threads > chunks)
+		num_threads = chunks;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (started = 0; started < num_threads; started++) {
+		struct worker *w = &worker[started];
+
+		w->vm = vm;
+		w->start = chunks * started / num_threads * CHUNK_SIZE;
+		w->end = chunks * (started + 1) / num_threads * CHUNK_SIZE;
+		w->ret = 0;
+
+		if (pthread_create(&w->thread, NULL, worker_thread, w) != 0) {
+			errorx("failed to start memory populating thread");
+			ret = -1;
+			break;
+		}
+	}
+
+	for (i = 0; i < started; i++) {
+		pthread_join(worker[i].thread, NULL);
+		ret |= worker[i].ret;
+	}
+
+	if (ret != 0)
+		return -1;
+
+	if (!report)
+		return 0;
+
+	ns = elapsed_ns(&start);
+	fprintf(stderr, "prealloc: %zu MiB in %.3f ms by %u threads, "
+		"%.2f GB/s\n", total >> 20, ns / 1e6, num_threads,
+		ns > 0 ? total / ns : 0);
+
+	return 0;
+}
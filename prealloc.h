@@ -0,0 +1,8 @@
+#ifndef _PREALLOC_H
+#define _PREALLOC_H
+
+struct vm;
+
+int prealloc_memory(struct vm *, unsigned, int);
+
+#endif /* _PREALLOC_H */
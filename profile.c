@@ -0,0 +1,563 @@
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <signal.h>
+#include <unistd.h>
+
+#include <linux/kvm.h>
+
+#include "kvm.h"
+#include "log.h"
+#include "profile.h"
+#include "symbol.h"
+
+#ifndef sigev_notify_thread_id
+# define sigev_notify_thread_id _sigev_un._tid
+#endif /* sigev_notify_thread_id */
+
+/**
+ * enum
+ *
+ * @MAX_DEPTH:      maximum number of sampled stack frames
+ * @MIN_BUCKETS:    initial number of stack hash table buckets
+ * @NSEC_PER_SEC:   nanoseconds per second
+ */
+enum {
+	MAX_DEPTH    = 32,
+	MIN_BUCKETS  = 256,
+	NSEC_PER_SEC = 1000000000,
+};
+
+/**
+ * struct stack - aggregated stack sample
+ *
+ * @count: number of samples with this stack
+ * @depth: number of frames, zero for an unused hash bucket
+ * @pc:    guest code addresses, innermost frame first
+ */
+struct stack {
+	uint64_t count;
+	unsigned depth;
+	uint64_t pc[MAX_DEPTH];
+};
+
+/**
+ * struct profile_vcpu - per virtual CPU profiler state
+ *
+ * Only ever accessed by the thread running the virtual CPU, so no locking
+ * is needed until the profile is reported.
+ *
+ * @timer:       sampling timer, delivering VCPU_KICK_SIGNAL
+ * @armed:       non-zero if the sampling timer was created
+ * @num_samples: number of taken samples
+ * @num_stacks:  number of distinct stacks
+ * @max_stacks:  number of stack hash table buckets
+ * @stack:       stack hash table
+ */
+struct profile_vcpu {
+	timer_t timer;
+	int armed;
+	uint64_t num_samples;
+	size_t num_stacks;
+	size_t max_stacks;
+	struct stack *stack;
+};
+
+/**
+ * struct profile - sampling guest profiler
+ *
+ * @vm:   profiled virtual machine
+ * @hz:   sampling frequency per second of virtual CPU time
+ * @vcpu: per virtual CPU profiler state
+ */
+struct profile {
+	struct vm *vm;
+	unsigned hz;
+	struct profile_vcpu vcpu[MAX_VCPUS];
+};
+
+/**
+ * struct folded - symbolized stack
+ *
+ * @line:  semicolon separated frames, outermost first
+ * @leaf:  innermost frame
+ * @count: number of samples
+ */
+struct folded {
+	char *line;
+	char *leaf;
+	uint64_t count;
+};
+
+/**
+ * profile_create() - create a profiler for a virtual machine
+ *
+ * @vm: virtual machine to profile
+ * @hz: sampling frequency per second of virtual CPU time
+ *
+ * Return: profiler, or NULL if an error occurred
+ */
+struct profile *profile_create(struct vm *vm, unsigned hz)
+{
+	struct profile *prof;
+
+	assert(vm != NULL);
+	assert(hz > 0 && hz <= NSEC_PER_SEC);
+
+	prof = calloc(1, sizeof(*prof));
+	if (prof == NULL) {
+		error("failed to allocate profiler");
+		return NULL;
+	}
+
+	prof->vm = vm;
+	prof->hz = hz;
+
+	return prof;
+}
+
+/**
+ * profile_attach() - start sampling a virtual CPU
+ *
+ * Must be called from the thread running the virtual CPU, as samples are
+ * taken on its CPU time clock and delivered to it.
+ *
+ * @prof: profiler
+ * @vcpu: virtual CPU identifier
+ *
+ * Return: zero on success, or -1 if an error occurred
+ */
+int profile_attach(struct profile *prof, unsigned vcpu)
+{
+	struct profile_vcpu *pv;
+	struct itimerspec its;
+	struct sigevent sev;
+
+	assert(prof != NULL);
+	assert(vcpu < MAX_VCPUS);
+
+	pv = &prof->vcpu[vcpu];
+	assert(!pv->armed);
+
+	memset(&sev, 0, sizeof(sev));
+	sev.sigev_notify = SIGEV_THREAD_ID;
+	sev.sigev_signo = VCPU_KICK_SIGNAL;
+	sev.sigev_notify_thread_id = gettid();
+
+	if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &pv->timer) != 0) {
+		error("failed to create profiling timer for VCPU #%u", vcpu);
+		return -1;
+	}
+
+	pv->armed = 1;
+
+	its.it_interval.tv_sec = 0;
+	its.it_interval.tv_nsec = NSEC_PER_SEC / prof->hz;
+	its.it_value = its.it_interval;
+
+	if (timer_settime(pv->timer, 0, &its, NULL) != 0) {
+		error("failed to start profiling timer for VCPU #%u", vcpu);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * walk_stack() - unwind guest stack following saved frame pointers
+ *
+ * Guest virtual addresses are expected to be identity mapped, as set up by
+ * vcpu_enable_paged_mode(), and are only offset by segment bases.
+ *
+ * @vm:    virtual machine descriptor
+ * @regs:  general purpose registers of the sampled virtual CPU
+ * @sregs: special registers of the sampled virtual CPU
+ * @pc:    where to store guest code addresses, innermost frame first
+ *
+ * Return: number of stored frames
+ */
+static unsigned walk_stack(struct vm *vm, const struct kvm_regs *regs,
+			   const struct kvm_sregs *sregs, uint64_t *pc)
+{
+	uint64_t fp, next, ret, mask;
+	const unsigned char *frame;
+	unsigned depth = 0;
+	size_t width;
+
+	width = sregs->cs.l ? 8 : sregs->cs.db ? 4 : 2;
+	mask = width == 8 ? UINT64_MAX : (UINT64_C(1) << (width * 8)) - 1;
+
+	pc[depth++] = sregs->cs.base + (regs->rip & mask);
+
+	for (fp = regs->rbp & mask; fp != 0 && depth < MAX_DEPTH; fp = next) {
+		frame = vm_probe_memory(vm, sregs->ss.base + fp, 2 * width);
+		if (frame == NULL)
+			break;
+
+		next = ret = 0;
+		memcpy(&next, frame, width);
+		memcpy(&ret, frame + width, width);
+		if (ret == 0)
+			break;
+
+		pc[depth++] = sregs->cs.base + ret;
+
+		/* Outer frames live above inner ones */
+		if (next <= fp)
+			break;
+	}
+
+	return depth;
+}
+
+/**
+ * hash_stack() - hash guest code addresses of a stack
+ *
+ * @pc:    guest code addresses
+ * @depth: number of addresses
+ *
+ * Return: hash value
+ */
+static uint64_t hash_stack(const uint64_t *pc, unsigned depth)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	unsigned i;
+
+	for (i = 0; i < depth; i++)
+		h = (h ^ pc[i]) * 0x100000001b3ULL;
+
+	return h;
+}
+
+/**
+ * find_stack() - find a stack hash table bucket for given addresses
+ *
+ * @stack:      stack hash table
+ * @max_stacks: number of buckets, a power of two
+ * @pc:         guest code addresses
+ * @depth:      number of addresses
+ *
+ * Return: bucket holding the stack, or an unused bucket
+ */
+static struct stack *find_stack(struct stack *stack, size_t max_stacks,
+				const uint64_t *pc, unsigned depth)
+{
+	size_t i;
+
+	for (i = hash_stack(pc, depth); /* NOTHING */; i++) {
+		struct stack *s = &stack[i & (max_stacks - 1)];
+
+		if (s->depth == 0 ||
+		    (s->depth == depth &&
+		     memcmp(s->pc, pc, depth * sizeof(*pc)) == 0))
+			return s;
+	}
+}
+
+/**
+ * grow_stacks() - double the number of stack hash table buckets
+ *
+ * @pv: per virtual CPU profiler state
+ *
+ * Return: zero on success, or -1 if an error occurred
+ */
+static int grow_stacks(struct profile_vcpu *pv)
+{
+	size_t max_stacks, i;
+	struct stack *stack;
+
+	max_stacks = pv->max_stacks != 0 ? pv->max_stacks * 2 : MIN_BUCKETS;
+	stack = calloc(max_stacks, sizeof(*stack));
+	if (stack == NULL)
+		return -1;
+
+	for (i = 0; i < pv->max_stacks; i++)
+		if (pv->stack[i].depth != 0)
+			*find_stack(stack, max_stacks, pv->stack[i].pc,
+				    pv->stack[i].depth) = pv->stack[i];
+
+	free(pv->stack);
+	pv->stack = stack;
+	pv->max_stacks = max_stacks;
+
+	return 0;
+}
+
+/**
+ * profile_sample() - record a sample of a virtual CPU interrupted by its
+ *                    profiling timer
+ *
+ * @prof: profiler
+ * @vcpu: virtual CPU identifier
+ */
+void profile_sample(struct profile *prof, unsigned vcpu)
+{
+	struct profile_vcpu *pv;
+	struct kvm_sregs sregs;
+	struct kvm_regs regs;
+	uint64_t pc[MAX_DEPTH];
+	struct stack *s;
+	unsigned depth;
+
+	assert(prof != NULL);
+	assert(vcpu < MAX_VCPUS);
+
+	pv = &prof->vcpu[vcpu];
+	if (vcpu_get_regs(prof->vm, vcpu, &regs) != 0 ||
+	    vcpu_get_sregs(prof->vm, vcpu, &sregs) != 0)
+		return;
+
+	depth = walk_stack(prof->vm, &regs, &sregs, pc);
+
+	if (pv->num_stacks * 2 >= pv->max_stacks && grow_stacks(pv) != 0) {
+		error("failed to grow VCPU #%u stack table", vcpu);
+		return;
+	}
+
+	s = find_stack(pv->stack, pv->max_stacks, pc, depth);
+	if (s->depth == 0) {
+		s->depth = depth;
+		memcpy(s->pc, pc, depth * sizeof(*pc));
+		pv->num_stacks++;
+	}
+
+	s->count++;
+	pv->num_samples++;
+}
+
+/**
+ * print_frame() - print a symbolized guest code address
+ *
+ * @stream: output stream
+ * @tab:    guest symbol table, or NULL
+ * @pc:     guest code address
+ */
+static void print_frame(FILE *stream, const struct symtab *tab, uint64_t pc)
+{
+	const char *name = NULL;
+
+	if (tab != NULL)
+		name = symtab_lookup(tab, pc, NULL);
+
+	if (name != NULL)
+		fputs(name, stream);
+	else
+		fprintf(stream, "0x%" PRIx64, pc);
+}
+
+/**
+ * compare_lines() - qsort(3) comparator ordering stacks by folded line
+ *
+ * @a: first symbolized stack
+ * @b: second symbolized stack
+ *
+ * Return: negative, zero or positive value as required by qsort(3)
+ */
+static int compare_lines(const void *a, const void *b)
+{
+	return strcmp(((const struct folded *) a)->line,
+		      ((const struct folded *) b)->line);
+}
+
+/**
+ * compare_leaves() - qsort(3) comparator ordering stacks by innermost frame
+ *
+ * @a: first symbolized stack
+ * @b: second symbolized stack
+ *
+ * Return: negative, zero or positive value as required by qsort(3)
+ */
+static int compare_leaves(const void *a, const void *b)
+{
+	return strcmp(((const struct folded *) a)->leaf,
+		      ((const struct folded *) b)->leaf);
+}
+
+/**
+ * compare_counts() - qsort(3) comparator ordering stacks by sample count,
+ *                    most frequent first
+ *
+ * @a: first symbolized stack
+ * @b: second symbolized stack
+ *
+ * Return: negative, zero or positive value as required by qsort(3)
+ */
+static int compare_counts(const void *a, const void *b)
+{
+	const struct folded *x = a, *y = b;
+
+	return (x->count < y->count) - (x->count > y->count);
+}
+
+/**
+ * merge_folded() - sum up sample counts of adjacent equal stacks, releasing
+ *                  merged ones
+ *
+ * @f:     sorted symbolized stacks
+ * @num:   number of stacks
+ * @equal: comparator used for sorting
+ *
+ * Return: number of remaining stacks
+ */
+static size_t merge_folded(struct folded *f, size_t num,
+			   int (*equal)(const void *, const void *))
+{
+	size_t i, n = 0;
+
+	for (i = 0; i < num; i++) {
+		if (n > 0 && equal(&f[n - 1], &f[i]) == 0) {
+			f[n - 1].count += f[i].count;
+			free(f[i].line);
+			continue;
+		}
+		f[n++] = f[i];
+	}
+
+	return n;
+}
+
+/**
+ * symbolize() - convert aggregated stacks of all virtual CPUs to folded lines
+ *
+ * @prof: profiler
+ * @tab:  guest symbol table, or NULL
+ * @f:    where to store symbolized stacks
+ *
+ * Return: number of symbolized stacks, or -1 if an error occurred
+ */
+static ssize_t symbolize(struct profile *prof, const struct symtab *tab,
+			 struct folded *f)
+{
+	struct profile_vcpu *pv;
+	struct stack *s;
+	size_t num = 0, len;
+	FILE *stream;
+	unsigned d;
+
+	for (pv = prof->vcpu; pv < prof->vcpu + MAX_VCPUS; pv++)
+		for (s = pv->stack; s < pv->stack + pv->max_stacks; s++) {
+			if (s->depth == 0)
+				continue;
+
+			stream = open_memstream(&f[num].line, &len);
+			if (stream == NULL)
+				return -1;
+
+			for (d = s->depth; d-- > 0; /* NOTHING */) {
+				print_frame(stream, tab, s->pc[d]);
+				if (d != 0)
+					fputc(';', stream);
+			}
+			fclose(stream);
+
+			f[num].leaf = strrchr(f[num].line, ';');
+			f[num].leaf = f[num].leaf != NULL ?
+			    f[num].leaf + 1 : f[num].line;
+			f[num].count = s->count;
+			num++;
+		}
+
+	return num;
+}
+
+/**
+ * profile_report() - print a flat profile and folded stacks
+ *
+ * Folded stacks are printed in a format understood by flamegraph.pl, one
+ * stack per line with frames separated by semicolons, followed by a sample
+ * count.
+ *
+ * @prof:   profiler
+ * @tab:    guest symbol table, or NULL to print raw addresses
+ * @flat:   output stream for the flat profile, or NULL
+ * @folded: output stream for folded stacks, or NULL
+ *
+ * Return: zero on success, or -1 if an error occurred
+ */
+int profile_report(struct profile *prof, const struct symtab *tab,
+		   FILE *flat, FILE *folded)
+{
+	uint64_t total = 0, cumulative = 0;
+	struct folded *f;
+	size_t num = 0, i;
+	ssize_t n;
+
+	assert(prof != NULL);
+
+	for (i = 0; i < MAX_VCPUS; i++) {
+		num += prof->vcpu[i].num_stacks;
+		total += prof->vcpu[i].num_samples;
+	}
+
+	f = calloc(num + 1, sizeof(*f));
+	if (f == NULL) {
+		error("failed to allocate profile report");
+		return -1;
+	}
+
+	n = symbolize(prof, tab, f);
+	if (n < 0) {
+		error("failed to symbolize profile");
+		for (i = 0; f[i].line != NULL; i++)
+			free(f[i].line);
+		free(f);
+		return -1;
+	}
+
+	qsort(f, n, sizeof(*f), compare_lines);
+	num = merge_folded(f, n, compare_lines);
+
+	if (folded != NULL)
+		for (i = 0; i < num; i++)
+			fprintf(folded, "%s %" PRIu64 "\n",
+				f[i].line, f[i].count);
+
+	/* Folded lines are not needed past this point, only their leaves */
+	if (flat != NULL) {
+		qsort(f, num, sizeof(*f), compare_leaves);
+		num = merge_folded(f, num, compare_leaves);
+		qsort(f, num, sizeof(*f), compare_counts);
+
+		fprintf(flat, "%10s %7s %7s  %s\n",
+			"samples", "self%", "cumul%", "symbol");
+		for (i = 0; i < num; i++) {
+			cumulative += f[i].count;
+			fprintf(flat, "%10" PRIu64 " %7.2f %7.2f  %s\n",
+				f[i].count, 100.0 * f[i].count / total,
+				100.0 * cumulative / total, f[i].leaf);
+		}
+		fprintf(flat, "%10" PRIu64 " samples total\n", total);
+	}
+
+	for (i = 0; i < num; i++)
+		free(f[i].line);
+	free(f);
+
+	return 0;
+}
+
+/**
+ * profile_destroy() - stop sampling and release a profiler
+ *
+ * @prof: profiler
+ */
+void profile_destroy(struct profile *prof)
+{
+	struct profile_vcpu *pv;
+
+	assert(prof != NULL);
+
+	for (pv = prof->vcpu; pv < prof->vcpu + MAX_VCPUS; pv++) {
+		if (pv->armed)
+			timer_delete(pv->timer);
+		free(pv->stack);
+	}
+
+	free(prof);
+}
@@ -0,0 +1,16 @@
+#ifndef _PROFILE_H
+#define _PROFILE_H
+
+#include <stdio.h>
+
+struct profile;
+struct symtab;
+struct vm;
+
+struct profile *profile_create(struct vm *, unsigned);
+int profile_attach(struct profile *, unsigned);
+void profile_sample(struct profile *, unsigned);
+int profile_report(struct profile *, const struct symtab *, FILE *, FILE *);
+void profile_destroy(struct profile *);
+
+#endif /* _PROFILE_H */
@@ -0,0 +1,356 @@
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/user.h>
+
+#include <linux/kvm.h>
+
+#include "kvm.h"
+#include "kvmapp.h"
+#include "log.h"
+#include "reclaim.h"
+
+#ifndef MADV_COLD
+# define MADV_COLD 20
+#endif /* MADV_COLD */
+
+#ifndef MADV_PAGEOUT
+# define MADV_PAGEOUT 21
+#endif /* MADV_PAGEOUT */
+
+/**
+ * enum
+ *
+ * @SAMPLES_PER_PERIOD: number of dirty page samples per idle period, the
+ *                      finer the more precise idle page detection is
+ */
+enum {
+	SAMPLES_PER_PERIOD = 4,
+};
+
+/**
+ * struct reclaim - idle guest memory reclaimer
+ *
+ * Only writes are tracked, as KVM logs dirty pages but not accessed ones,
+ * so pages that are only read are deemed idle. Reading them back after
+ * reclaim costs a host page fault but is otherwise harmless.
+ *
+ * @vm:          virtual machine descriptor
+ * @advice:      MADV_COLD or MADV_PAGEOUT
+ * @interval_ms: sampling interval in milliseconds
+ * @thread:      sampling thread
+ * @lock:        protects @stopping and @stats
+ * @cond:        signalled when @stopping is set
+ * @stopping:    non-zero once the sampling thread has to exit
+ * @ret:         zero, or -1 if the sampling thread failed
+ * @stats:       memory usage estimate as of the last sample
+ * @dirty:       dirty page bitmaps, one per memory region
+ * @reclaimed:   bitmaps of pages advised and not written since, one per
+ *               memory region
+ * @last_write:  per page number of the last sample that found the page
+ *               written, one array per memory region
+ */
+struct reclaim {
+	struct vm *vm;
+	int advice;
+	unsigned interval_ms;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int stopping;
+	int ret;
+	struct reclaim_stats stats;
+	uint64_t *dirty[MAX_MEMSLOTS];
+	uint64_t *reclaimed[MAX_MEMSLOTS];
+	uint32_t *last_write[MAX_MEMSLOTS];
+};
+
+/**
+ * advise() - hand idle guest pages over to the host kernel
+ *
+ * @r:     idle guest memory reclaimer
+ * @slot:  memory region
+ * @first: index of the first idle page
+ * @count: number of idle pages
+ *
+ * Return: zero on success, or -1 if an error occurred
+ */
+static int advise(struct reclaim *r,
+		  const struct kvm_userspace_memory_region *slot,
+		  size_t first, size_t count)
+{
+	if (count == 0)
+		return 0;
+
+	if (madvise((void *) (uintptr_t) slot->userspace_addr +
+		    first * PAGE_SIZE, count * PAGE_SIZE, r->advice) != 0) {
+		error("failed to reclaim idle guest memory");
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * sample() - fetch dirty pages, advise pages that became idle and update
+ *            memory usage estimate
+ *
+ * Runs of adjacent idle pages are advised with a single system call.
+ *
+ * @r:     idle guest memory reclaimer
+ * @stats: where to store memory usage estimate
+ *
+ * Return: zero on success, or -1 if an error occurred
+ */
+static int sample(struct reclaim *r, struct reclaim_stats *stats)
+{
+	const struct kvm_userspace_memory_region *slot;
+	size_t p, num_pages, run;
+	uint32_t now;
+	unsigned i;
+
+	now = ++stats->num_samples;
+	stats->working_set = stats->idle = 0;
+
+	for (i = 0; (slot = vm_get_memslot(r->vm, i)) != NULL; i++) {
+		uint64_t *dirty = r->dirty[i], *reclaimed = r->reclaimed[i];
+		uint32_t *last_write = r->last_write[i];
+
+		if (vm_get_dirty_log(r->vm, i, dirty) != 0)
+			return -1;
+
+		num_pages = slot->memory_size / PAGE_SIZE;
+		for (p = 0, run = 0; p < num_pages; p++) {
+			if ((dirty[p / 64] & 1ULL << p % 64) != 0) {
+				last_write[p] = now;
+				reclaimed[p / 64] &= ~(1ULL << p % 64);
+			}
+
+			if (now - last_write[p] < SAMPLES_PER_PERIOD) {
+				stats->working_set += PAGE_SIZE;
+			} else {
+				stats->idle += PAGE_SIZE;
+				if ((reclaimed[p / 64] & 1ULL << p % 64) == 0) {
+					reclaimed[p / 64] |= 1ULL << p % 64;
+					stats->reclaimed += PAGE_SIZE;
+					run++;
+					continue;
+				}
+			}
+
+			if (advise(r, slot, p - run, run) != 0)
+				return -1;
+			run = 0;
+		}
+
+		if (advise(r, slot, p - run, run) != 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * reclaim_thread() - sample guest memory once per interval until stopped
+ *
+ * @arg: idle guest memory reclaimer
+ *
+ * Return: NULL
+ */
+static void *reclaim_thread(void *arg)
+{
+	struct reclaim *r = arg;
+	struct reclaim_stats stats;
+	struct timespec deadline;
+
+	pthread_mutex_lock(&r->lock);
+	stats = r->stats;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+	for (;;) {
+		deadline.tv_nsec += (long) (r->interval_ms % 1000) * 1000000;
+		deadline.tv_sec += r->interval_ms / 1000 +
+		    deadline.tv_nsec / 1000000000;
+		deadline.tv_nsec %= 1000000000;
+
+		while (!r->stopping &&
+		       pthread_cond_timedwait(&r->cond, &r->lock,
+					      &deadline) != ETIMEDOUT)
+			/* NOTHING */;
+
+		if (r->stopping)
+			break;
+
+		/* Dirty log is fetched without holding up stats readers */
+		pthread_mutex_unlock(&r->lock);
+		r->ret = sample(r, &stats);
+		pthread_mutex_lock(&r->lock);
+
+		if (r->ret != 0)
+			break;
+		r->stats = stats;
+	}
+
+	pthread_mutex_unlock(&r->lock);
+
+	return NULL;
+}
+
+/**
+ * free_reclaim() - release memory of an idle guest memory reclaimer
+ *
+ * @r: idle guest memory reclaimer
+ */
+static void free_reclaim(struct reclaim *r)
+{
+	unsigned i;
+
+	for (i = 0; i < MAX_MEMSLOTS; i++) {
+		free(r->dirty[i]);
+		free(r->reclaimed[i]);
+		free(r->last_write[i]);
+	}
+
+	free(r);
+}
+
+/**
+ * reclaim_start() - start reclaiming guest memory that is not written for
+ *                   a while
+ *
+ * Dirty page logging is enabled on all memory regions, so that it cannot
+ * be used by anything else meanwhile.
+ *
+ * @vm:      virtual machine descriptor
+ * @idle_ms: period after which unwritten pages are reclaimed, in
+ *           milliseconds
+ * @pageout: non-zero to page idle memory out right away, or zero to only
+ *           mark it as first to reclaim under memory pressure
+ *
+ * Return: idle guest memory reclaimer, or NULL if an error occurred
+ */
+struct reclaim *reclaim_start(struct vm *vm, unsigned idle_ms, int pageout)
+{
+	const struct kvm_userspace_memory_region *slot;
+	pthread_condattr_t attr;
+	struct reclaim *r;
+	size_t num_pages;
+	unsigned i;
+
+	assert(vm != NULL);
+	assert(idle_ms > 0);
+
+	r = calloc(1, sizeof(*r));
+	if (r == NULL) {
+		error("failed to allocate memory reclaimer");
+		return NULL;
+	}
+
+	r->vm = vm;
+	r->advice = pageout ? MADV_PAGEOUT : MADV_COLD;
+	r->interval_ms = idle_ms > SAMPLES_PER_PERIOD ?
+	    idle_ms / SAMPLES_PER_PERIOD : 1;
+
+	for (i = 0; (slot = vm_get_memslot(vm, i)) != NULL; i++) {
+		num_pages = slot->memory_size / PAGE_SIZE;
+		r->stats.total += slot->memory_size;
+		r->dirty[i] = calloc(round_up(num_pages, 64) / 8, 1);
+		r->reclaimed[i] = calloc(round_up(num_pages, 64) / 8, 1);
+		r->last_write[i] = calloc(num_pages, sizeof(uint32_t));
+		if (r->dirty[i] == NULL || r->reclaimed[i] == NULL ||
+		    r->last_write[i] == NULL) {
+			error("failed to allocate page usage maps");
+			goto err;
+		}
+	}
+
+	for (i = 0; (slot = vm_get_memslot(vm, i)) != NULL; i++)
+		if (vm_set_dirty_log(vm, i, 1) != 0)
+			goto err;
+
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&r->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if (pthread_create(&r->thread, NULL, reclaim_thread, r) == 0)
+		return r;
+
+	errorx("failed to start memory reclaim thread");
+	pthread_cond_destroy(&r->cond);
+	pthread_mutex_destroy(&r->lock);
+
+err:
+	for (i = 0; (slot = vm_get_memslot(vm, i)) != NULL; i++)
+		if ((slot->flags & KVM_MEM_LOG_DIRTY_PAGES) != 0)
+			vm_set_dirty_log(vm, i, 0);
+
+	free_reclaim(r);
+
+	return NULL;
+}
+
+/**
+ * reclaim_get_stats() - get the latest guest memory usage estimate
+ *
+ * May be called from any thread.
+ *
+ * @r:     idle guest memory reclaimer
+ * @stats: where to store memory usage estimate
+ */
+void reclaim_get_stats(struct reclaim *r, struct reclaim_stats *stats)
+{
+	assert(r != NULL);
+	assert(stats != NULL);
+
+	pthread_mutex_lock(&r->lock);
+	*stats = r->stats;
+	pthread_mutex_unlock(&r->lock);
+}
+
+/**
+ * reclaim_stop() - stop reclaiming guest memory and report its usage
+ *
+ * @r: idle guest memory reclaimer
+ *
+ * Return: zero on success, or -1 if reclaiming failed
+ */
+int reclaim_stop(struct reclaim *r)
+{
+	const struct kvm_userspace_memory_region *slot;
+	unsigned i;
+	int ret;
+
+	assert(r != NULL);
+
+	pthread_mutex_lock(&r->lock);
+	r->stopping = 1;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+
+	pthread_join(r->thread, NULL);
+
+	for (i = 0; (slot = vm_get_memslot(r->vm, i)) != NULL; i++)
+		vm_set_dirty_log(r->vm, i, 0);
+
+	fprintf(stderr, "reclaim: working set %.2f MiB, idle %.2f MiB of "
+		"%.2f MiB, %.2f MiB reclaimed in %" PRIu64 " samples\n",
+		r->stats.working_set / 1048576.0, r->stats.idle / 1048576.0,
+		r->stats.total / 1048576.0, r->stats.reclaimed / 1048576.0,
+		r->stats.num_samples);
+
+	ret = r->ret;
+	pthread_cond_destroy(&r->cond);
+	pthread_mutex_destroy(&r->lock);
+	free_reclaim(r);
+
+	return ret;
+}
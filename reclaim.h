@@ -0,0 +1,31 @@
+#ifndef _RECLAIM_H
+#define _RECLAIM_H
+
+#include <stdint.h>
+
+struct reclaim;
+struct vm;
+
+/**
+ * struct reclaim_stats - guest memory usage estimate
+ *
+ * @num_samples: number of dirty page samples taken
+ * @total:       guest memory size in bytes
+ * @working_set: bytes written within the last idle period
+ * @idle:        bytes not written within the last idle period
+ * @reclaimed:   bytes advised to the host kernel so far, counting pages
+ *               reclaimed again after being written once more
+ */
+struct reclaim_stats {
+	uint64_t num_samples;
+	uint64_t total;
+	uint64_t working_set;
+	uint64_t idle;
+	uint64_t reclaimed;
+};
+
+struct reclaim *reclaim_start(struct vm *, unsigned, int);
+void reclaim_get_stats(struct reclaim *, struct reclaim_stats *);
+int reclaim_stop(struct reclaim *);
+
+#endif /* _RECLAIM_H */
@@ -0,0 +1,214 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/user.h>
+
+#include <linux/kvm.h>
+
+#include "bulk.h"
+#include "kvm.h"
+#include "kvmapp.h"
+#include "log.h"
+#include "snapshot.h"
+#include "vcpu.h"
+
+/**
+ * struct snapshot - saved virtual machine state to reset it to
+ *
+ * Memory is tracked with dirty page logging from the moment it is saved,
+ * so that only pages written since have to be copied back.
+ *
+ * @vm:     virtual machine descriptor
+ * @clock:  guest clock in nanoseconds
+ * @mem:    copies of memory region contents, one per memory region
+ * @bitmap: dirty page bitmaps, one per memory region
+ * @vcpu:   saved state, one per virtual CPU
+ */
+struct snapshot {
+	struct vm *vm;
+	uint64_t clock;
+	uint8_t *mem[MAX_MEMSLOTS];
+	uint64_t *bitmap[MAX_MEMSLOTS];
+	struct vcpu_snapshot vcpu[MAX_VCPUS];
+};
+
+/**
+ * restore_pages() - copy back runs of dirty pages of a memory region
+ *
+ * @s:    virtual machine snapshot
+ * @i:    ID of the memory region
+ * @slot: memory region
+ *
+ * Return: number of restored pages
+ */
+static size_t restore_pages(struct snapshot *s, unsigned i,
+			    const struct kvm_userspace_memory_region *slot)
+{
+	size_t num_pages = slot->memory_size / PAGE_SIZE;
+	uint8_t *hva = (void *) (uintptr_t) slot->userspace_addr;
+	const uint64_t *bitmap = s->bitmap[i];
+	size_t p, run, restored = 0;
+
+	for (p = 0; p < num_pages; p += run) {
+		/* Clean stretches are skipped a bitmap word at a time */
+		if (p % 64 == 0 && bitmap[p / 64] == 0) {
+			run = 64;
+			continue;
+		}
+
+		for (run = 0; p + run < num_pages; run++)
+			if ((bitmap[(p + run) / 64] &
+			     1ULL << (p + run) % 64) == 0)
+				break;
+
+		if (run == 0) {
+			run = 1;
+			continue;
+		}
+
+		/* Guest touches restored pages again, keep them cached */
+		memcpy(hva + p * PAGE_SIZE, s->mem[i] + p * PAGE_SIZE,
+		       run * PAGE_SIZE);
+		restored += run;
+	}
+
+	return restored;
+}
+
+/**
+ * free_snapshot() - release memory of a virtual machine snapshot
+ *
+ * @s: virtual machine snapshot
+ */
+static void free_snapshot(struct snapshot *s)
+{
+	unsigned i;
+
+	for (i = 0; i < MAX_MEMSLOTS; i++) {
+		free(s->mem[i]);
+		free(s->bitmap[i]);
+	}
+
+	free(s);
+}
+
+/**
+ * snapshot_take() - save virtual machine state to reset it to later
+ *
+ * Dirty page logging is enabled on all memory regions until the snapshot
+ * is freed, so that it cannot be used by anything else meanwhile.
+ *
+ * @vm: virtual machine descriptor with stopped virtual CPUs
+ *
+ * Return: virtual machine snapshot, or NULL if an error occurred
+ */
+struct snapshot *snapshot_take(struct vm *vm)
+{
+	const struct kvm_userspace_memory_region *slot;
+	struct snapshot *s;
+	size_t num_pages;
+	unsigned i;
+
+	assert(vm != NULL);
+
+	s = calloc(1, sizeof(*s));
+	if (s == NULL) {
+		error("failed to allocate snapshot");
+		return NULL;
+	}
+
+	s->vm = vm;
+
+	for (i = 0; i < vm_get_num_vcpus(vm); i++)
+		if (vcpu_save(vm, i, &s->vcpu[i]) != 0)
+			goto err;
+
+	if (vm_get_clock(vm, &s->clock) != 0)
+		goto err;
+
+	for (i = 0; (slot = vm_get_memslot(vm, i)) != NULL; i++) {
+		num_pages = slot->memory_size / PAGE_SIZE;
+		s->mem[i] = malloc(slot->memory_size);
+		s->bitmap[i] = calloc(round_up(num_pages, 64) / 8, 1);
+		if (s->mem[i] == NULL || s->bitmap[i] == NULL) {
+			error("failed to allocate snapshot of memory region "
+			      "#%u", i);
+			goto err;
+		}
+
+		bulk_copy(s->mem[i], (void *) (uintptr_t) slot->userspace_addr,
+			  slot->memory_size);
+	}
+
+	for (i = 0; (slot = vm_get_memslot(vm, i)) != NULL; i++)
+		if (vm_set_dirty_log(vm, i, 1) != 0)
+			goto err;
+
+	return s;
+
+err:
+	for (i = 0; (slot = vm_get_memslot(vm, i)) != NULL; i++)
+		if ((slot->flags & KVM_MEM_LOG_DIRTY_PAGES) != 0)
+			vm_set_dirty_log(vm, i, 0);
+
+	free_snapshot(s);
+
+	return NULL;
+}
+
+/**
+ * snapshot_restore() - reset a virtual machine to a snapshot
+ *
+ * Only pages written since the snapshot or the previous reset are copied
+ * back, so the cost follows what the guest touched rather than its memory
+ * size. The snapshot stays valid for further resets.
+ *
+ * @s: virtual machine snapshot of a virtual machine with stopped virtual
+ *     CPUs
+ *
+ * Return: number of restored pages, or -1 if an error occurred
+ */
+ssize_t snapshot_restore(struct snapshot *s)
+{
+	const struct kvm_userspace_memory_region *slot;
+	size_t restored = 0;
+	unsigned i;
+
+	assert(s != NULL);
+
+	for (i = 0; (slot = vm_get_memslot(s->vm, i)) != NULL; i++) {
+		if (vm_get_dirty_log(s->vm, i, s->bitmap[i]) != 0)
+			return -1;
+
+		restored += restore_pages(s, i, slot);
+	}
+
+	for (i = 0; i < vm_get_num_vcpus(s->vm); i++)
+		if (vcpu_load(s->vm, i, &s->vcpu[i]) != 0)
+			return -1;
+
+	if (vm_set_clock(s->vm, s->clock) != 0)
+		return -1;
+
+	return restored;
+}
+
+/**
+ * snapshot_free() - stop tracking a virtual machine and release its
+ *                   snapshot
+ *
+ * @s: virtual machine snapshot
+ */
+void snapshot_free(struct snapshot *s)
+{
+	const struct kvm_userspace_memory_region *slot;
+	unsigned i;
+
+	assert(s != NULL);
+
+	for (i = 0; (slot = vm_get_memslot(s->vm, i)) != NULL; i++)
+		vm_set_dirty_log(s->vm, i, 0);
+
+	free_snapshot(s);
+}
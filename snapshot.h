@@ -0,0 +1,13 @@
+#ifndef _SNAPSHOT_H
+#define _SNAPSHOT_H
+
+#include <sys/types.h>
+
+struct snapshot;
+struct vm;
+
+struct snapshot *snapshot_take(struct vm *);
+ssize_t snapshot_restore(struct snapshot *);
+void snapshot_free(struct snapshot *);
+
+#endif /* _SNAPSHOT_H */
@@ -0,0 +1,536 @@
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include <linux/kvm.h>
+
+#include "kvm.h"
+#include "log.h"
+#include "reclaim.h"
+#include "stats.h"
+
+/**
+ * struct stats_source - binary statistics of a virtual machine or CPU
+ *
+ * Descriptors are parsed once, every later read is a single pread(2) of the
+ * data block.
+ *
+ * @fd:          binary statistics file descriptor
+ * @vcpu:        virtual CPU identifier, or -1 for the virtual machine
+ * @num_desc:    number of statistics
+ * @desc_size:   size of a descriptor, including its name
+ * @desc:        descriptors, @desc_size bytes apart
+ * @data_offset: data block offset in the file
+ * @data_size:   data block size
+ * @data:        data block as of the last read
+ */
+struct stats_source {
+	int fd;
+	int vcpu;
+	unsigned num_desc;
+	size_t desc_size;
+	uint8_t *desc;
+	off_t data_offset;
+	size_t data_size;
+	uint64_t *data;
+};
+
+/**
+ * struct stats - periodic statistics exporter
+ *
+ * @vm:          virtual machine descriptor
+ * @path:        metrics file path
+ * @tmp_path:    file path metrics are written to before renaming
+ * @interval_ms: export interval in milliseconds
+ * @reclaim:     idle guest memory reclaimer to export estimates of, or NULL
+ * @thread:      exporting thread
+ * @lock:        protects @stopping
+ * @cond:        signalled when @stopping is set
+ * @stopping:    non-zero once the exporting thread has to exit
+ * @ret:         zero, or -1 if the exporting thread failed
+ * @num_sources: number of statistics sources
+ * @source:      virtual machine statistics, then those of every VCPU
+ */
+struct stats {
+	struct vm *vm;
+	const char *path;
+	char *tmp_path;
+	unsigned interval_ms;
+	struct reclaim *reclaim;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int stopping;
+	int ret;
+	unsigned num_sources;
+	struct stats_source source[1 + MAX_VCPUS];
+};
+
+/**
+ * get_desc() - get a statistics descriptor
+ *
+ * @src: statistics source
+ * @i:   descriptor index
+ *
+ * Return: descriptor
+ */
+static const struct kvm_stats_desc *get_desc(const struct stats_source *src,
+					     unsigned i)
+{
+	return (const struct kvm_stats_desc *) (src->desc + i * src->desc_size);
+}
+
+/**
+ * open_source() - parse statistics descriptors and allocate a data block
+ *
+ * @src:  statistics source to set up
+ * @fd:   binary statistics file descriptor
+ * @vcpu: virtual CPU identifier, or -1 for the virtual machine
+ *
+ * Return: zero on success, or -1 if an error occurred
+ */
+static int open_source(struct stats_source *src, int fd, int vcpu)
+{
+	const struct kvm_stats_desc *d;
+	struct kvm_stats_header hdr;
+	size_t size, end;
+	unsigned i;
+
+	src->fd = fd;
+	src->vcpu = vcpu;
+
+	if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    hdr.num_desc == 0 || hdr.name_size == 0) {
+		errorx("malformed KVM statistics header");
+		return -1;
+	}
+
+	src->num_desc = hdr.num_desc;
+	src->desc_size = sizeof(*d) + hdr.name_size;
+	size = src->num_desc * src->desc_size;
+	src->desc = malloc(size);
+	if (src->desc == NULL) {
+		error("failed to allocate KVM statistics descriptors");
+		return -1;
+	}
+
+	if (pread(fd, src->desc, size, hdr.desc_offset) != (ssize_t) size) {
+		errorx("truncated KVM statistics descriptors");
+		return -1;
+	}
+
+	/* Data block ends with the last value of any statistic */
+	for (i = 0; i < src->num_desc; i++) {
+		d = get_desc(src, i);
+		src->desc[(i + 1) * src->desc_size - 1] = '\0';
+		if (d->offset % sizeof(uint64_t) != 0) {
+			errorx("misaligned KVM statistic %s", d->name);
+			return -1;
+		}
+		end = d->offset + d->size * sizeof(uint64_t);
+		if (end > src->data_size)
+			src->data_size = end;
+	}
+
+	src->data_offset = hdr.data_offset;
+	src->data = malloc(src->data_size);
+	if (src->data == NULL) {
+		error("failed to allocate KVM statistics data");
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * read_source() - read current statistics values
+ *
+ * @src: statistics source
+ *
+ * Return: zero on success, or -1 if an error occurred
+ */
+static int read_source(struct stats_source *src)
+{
+	if (pread(src->fd, src->data, src->data_size, src->data_offset) !=
+	    (ssize_t) src->data_size) {
+		error("failed to read KVM statistics");
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * put_bucket_le() - print the upper bound of a histogram bucket
+ *
+ * Values are integers, so the inclusive bound of a bucket is one less than
+ * where the next one starts. Linear buckets are bucket_size wide, bucket 0
+ * of logarithmic ones counts zeroes and bucket k >= 1 covers
+ * [2^(k - 1), 2^k). The last bucket counts everything above the others.
+ *
+ * @stream: output stream
+ * @d:      histogram descriptor
+ * @k:      bucket index
+ */
+static void put_bucket_le(FILE *stream, const struct kvm_stats_desc *d,
+			  unsigned k)
+{
+	uint64_t le;
+
+	if (k + 1 == d->size) {
+		fprintf(stream, "+Inf");
+		return;
+	}
+
+	if ((d->flags & KVM_STATS_TYPE_MASK) == KVM_STATS_TYPE_LINEAR_HIST)
+		le = (uint64_t) (k + 1) * d->bucket_size - 1;
+	else
+		le = k < 64 ? (UINT64_C(1) << k) - 1 : UINT64_MAX;
+
+	fprintf(stream, "%" PRIu64, le);
+}
+
+/**
+ * put_histogram() - print one histogram of a set of sources
+ *
+ * KVM counts samples per bucket, these are summed up into cumulative
+ * buckets. KVM keeps no sum of sampled values, so there is no _sum sample.
+ *
+ * @stream:      output stream
+ * @prefix:      metric name prefix
+ * @src:         statistics sources
+ * @num_sources: number of statistics sources
+ * @i:           descriptor index
+ */
+static void put_histogram(FILE *stream, const char *prefix,
+			  const struct stats_source *src, unsigned num_sources,
+			  unsigned i)
+{
+	const struct kvm_stats_desc *d = get_desc(src, i);
+	uint64_t count;
+	unsigned j, k;
+
+	fprintf(stream, "# TYPE %s%s histogram\n", prefix, d->name);
+
+	for (j = 0; j < num_sources; j++) {
+		for (count = 0, k = 0; k < d->size; k++) {
+			count += src[j].data[d->offset / sizeof(uint64_t) + k];
+			fprintf(stream, "%s%s_bucket{", prefix, d->name);
+			if (src[j].vcpu >= 0)
+				fprintf(stream, "vcpu=\"%d\",", src[j].vcpu);
+			fprintf(stream, "le=\"");
+			put_bucket_le(stream, d, k);
+			fprintf(stream, "\"} %" PRIu64 "\n", count);
+		}
+
+		fprintf(stream, "%s%s_count", prefix, d->name);
+		if (src[j].vcpu >= 0)
+			fprintf(stream, "{vcpu=\"%d\"}", src[j].vcpu);
+		fprintf(stream, " %" PRIu64 "\n", count);
+	}
+}
+
+/**
+ * put_family() - print one statistic of a set of sources as a metric family
+ *
+ * Sources share their descriptors, as they are all virtual CPUs or the
+ * virtual machine alone.
+ *
+ * @stream:      output stream
+ * @prefix:      metric name prefix
+ * @src:         statistics sources
+ * @num_sources: number of statistics sources
+ * @i:           descriptor index
+ */
+static void put_family(FILE *stream, const char *prefix,
+		       const struct stats_source *src, unsigned num_sources,
+		       unsigned i)
+{
+	const struct kvm_stats_desc *d = get_desc(src, i);
+	const char *type;
+	unsigned j, k;
+
+	switch (d->flags & KVM_STATS_TYPE_MASK) {
+	case KVM_STATS_TYPE_CUMULATIVE:
+		type = "counter";
+		break;
+	case KVM_STATS_TYPE_INSTANT:
+	case KVM_STATS_TYPE_PEAK:
+		type = "gauge";
+		break;
+	case KVM_STATS_TYPE_LINEAR_HIST:
+	case KVM_STATS_TYPE_LOG_HIST:
+		put_histogram(stream, prefix, src, num_sources, i);
+		return;
+	default:
+		type = "untyped";
+		break;
+	}
+
+	fprintf(stream, "# TYPE %s%s %s\n", prefix, d->name, type);
+
+	for (j = 0; j < num_sources; j++)
+		for (k = 0; k < d->size; k++) {
+			fprintf(stream, "%s%s", prefix, d->name);
+			if (src[j].vcpu >= 0 && d->size > 1)
+				fprintf(stream, "{vcpu=\"%d\",index=\"%u\"}",
+					src[j].vcpu, k);
+			else if (src[j].vcpu >= 0)
+				fprintf(stream, "{vcpu=\"%d\"}", src[j].vcpu);
+			else if (d->size > 1)
+				fprintf(stream, "{index=\"%u\"}", k);
+			fprintf(stream, " %" PRIu64 "\n",
+				src[j].data[d->offset / sizeof(uint64_t) + k]);
+		}
+}
+
+/**
+ * put_reclaim() - print guest memory usage estimate metrics
+ *
+ * @stream: output stream
+ * @r:      idle guest memory reclaimer
+ */
+static void put_reclaim(FILE *stream, struct reclaim *r)
+{
+	struct reclaim_stats rs;
+
+	reclaim_get_stats(r, &rs);
+	fprintf(stream,
+		"# TYPE kvmapp_reclaim_samples counter\n"
+		"kvmapp_reclaim_samples %" PRIu64 "\n"
+		"# TYPE kvmapp_reclaim_total_bytes gauge\n"
+		"kvmapp_reclaim_total_bytes %" PRIu64 "\n"
+		"# TYPE kvmapp_reclaim_working_set_bytes gauge\n"
+		"kvmapp_reclaim_working_set_bytes %" PRIu64 "\n"
+		"# TYPE kvmapp_reclaim_idle_bytes gauge\n"
+		"kvmapp_reclaim_idle_bytes %" PRIu64 "\n"
+		"# TYPE kvmapp_reclaim_reclaimed_bytes counter\n"
+		"kvmapp_reclaim_reclaimed_bytes %" PRIu64 "\n",
+		rs.num_samples, rs.total, rs.working_set, rs.idle,
+		rs.reclaimed);
+}
+
+/**
+ * export() - read all statistics and replace the metrics file with them
+ *
+ * Metrics are written to a temporary file renamed over the metrics file, so
+ * that readers never see a partial export.
+ *
+ * @s: statistics exporter
+ *
+ * Return: zero on success, or -1 if an error occurred
+ */
+static int export(struct stats *s)
+{
+	FILE *stream;
+	unsigned i;
+
+	for (i = 0; i < s->num_sources; i++)
+		if (read_source(&s->source[i]) != 0)
+			return -1;
+
+	stream = fopen(s->tmp_path, "w");
+	if (stream == NULL) {
+		error("%s", s->tmp_path);
+		return -1;
+	}
+
+	for (i = 0; i < s->source[0].num_desc; i++)
+		put_family(stream, "kvm_vm_", &s->source[0], 1, i);
+
+	for (i = 0; s->num_sources > 1 && i < s->source[1].num_desc; i++)
+		put_family(stream, "kvm_vcpu_", &s->source[1],
+			   s->num_sources - 1, i);
+
+	if (s->reclaim != NULL)
+		put_reclaim(stream, s->reclaim);
+
+	if (fclose(stream) != 0) {
+		error("%s", s->tmp_path);
+		return -1;
+	}
+
+	if (rename(s->tmp_path, s->path) != 0) {
+		error("%s", s->path);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * stats_thread() - export statistics once per interval until stopped
+ *
+ * @arg: statistics exporter
+ *
+ * Return: NULL
+ */
+static void *stats_thread(void *arg)
+{
+	struct stats *s = arg;
+	struct timespec deadline;
+
+	pthread_mutex_lock(&s->lock);
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+	for (;;) {
+		deadline.tv_nsec += (long) (s->interval_ms % 1000) * 1000000;
+		deadline.tv_sec += s->interval_ms / 1000 +
+		    deadline.tv_nsec / 1000000000;
+		deadline.tv_nsec %= 1000000000;
+
+		while (!s->stopping &&
+		       pthread_cond_timedwait(&s->cond, &s->lock,
+					      &deadline) != ETIMEDOUT)
+			/* NOTHING */;
+
+		if (s->stopping)
+			break;
+
+		pthread_mutex_unlock(&s->lock);
+		s->ret = export(s);
+		pthread_mutex_lock(&s->lock);
+
+		if (s->ret != 0)
+			break;
+	}
+
+	pthread_mutex_unlock(&s->lock);
+
+	return NULL;
+}
+
+/**
+ * free_stats() - release memory of a statistics exporter
+ *
+ * @s: statistics exporter
+ */
+static void free_stats(struct stats *s)
+{
+	unsigned i;
+
+	for (i = 0; i < s->num_sources; i++) {
+		free(s->source[i].desc);
+		free(s->source[i].data);
+	}
+
+	free(s->tmp_path);
+	free(s);
+}
+
+/**
+ * stats_start() - start exporting KVM statistics in Prometheus text format
+ *
+ * The metrics file is replaced once per interval and a last time when
+ * stopping.
+ *
+ * @vm:          virtual machine descriptor, with all its VCPUs created
+ * @path:        metrics file path
+ * @interval_ms: export interval in milliseconds
+ * @reclaim:     idle guest memory reclaimer to export estimates of, or NULL
+ *
+ * Return: statistics exporter, or NULL if an error occurred
+ */
+struct stats *stats_start(struct vm *vm, const char *path,
+			  unsigned interval_ms, struct reclaim *reclaim)
+{
+	pthread_condattr_t attr;
+	struct stats *s;
+	unsigned i;
+	int fd;
+
+	assert(vm != NULL);
+	assert(path != NULL);
+	assert(interval_ms > 0);
+
+	if (vm_get_stats_fd(vm) < 0) {
+		errorx("KVM does not provide binary statistics");
+		return NULL;
+	}
+
+	s = calloc(1, sizeof(*s));
+	if (s == NULL) {
+		error("failed to allocate statistics exporter");
+		return NULL;
+	}
+
+	s->vm = vm;
+	s->path = path;
+	s->interval_ms = interval_ms;
+	s->reclaim = reclaim;
+
+	s->tmp_path = malloc(strlen(path) + sizeof(".tmp"));
+	if (s->tmp_path == NULL) {
+		error("failed to allocate statistics exporter");
+		goto err;
+	}
+	sprintf(s->tmp_path, "%s.tmp", path);
+
+	for (i = 0; i <= vm_get_num_vcpus(vm); i++) {
+		fd = i == 0 ? vm_get_stats_fd(vm) :
+		    vcpu_get_stats_fd(vm, i - 1);
+		s->num_sources++;
+		if (open_source(&s->source[i], fd, (int) i - 1) != 0)
+			goto err;
+	}
+
+	/* Metrics are there from the start, even for short runs */
+	if (export(s) != 0)
+		goto err;
+
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&s->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if (pthread_create(&s->thread, NULL, stats_thread, s) == 0)
+		return s;
+
+	errorx("failed to start statistics thread");
+	pthread_cond_destroy(&s->cond);
+	pthread_mutex_destroy(&s->lock);
+
+err:
+	free_stats(s);
+
+	return NULL;
+}
+
+/**
+ * stats_stop() - stop exporting statistics, leaving final values behind
+ *
+ * @s: statistics exporter
+ *
+ * Return: zero on success, or -1 if exporting failed
+ */
+int stats_stop(struct stats *s)
+{
+	int ret;
+
+	assert(s != NULL);
+
+	pthread_mutex_lock(&s->lock);
+	s->stopping = 1;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+
+	pthread_join(s->thread, NULL);
+
+	ret = s->ret;
+	if (ret == 0)
+		ret = export(s);
+
+	pthread_cond_destroy(&s->cond);
+	pthread_mutex_destroy(&s->lock);
+	free_stats(s);
+
+	return ret;
+}
@@ -0,0 +1,12 @@
+#ifndef _STATS_H
+#define _STATS_H
+
+struct reclaim;
+struct stats;
+struct vm;
+
+struct stats *stats_start(struct vm *, const char *, unsigned,
+			  struct reclaim *);
+int stats_stop(struct stats *);
+
+#endif /* _STATS_H */
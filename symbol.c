@@ -0,0 +1,395 @@
+#include <assert.h>
+#include <ctype.h>
+#include <elf.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "symbol.h"
+
+/**
+ * struct symbol - guest symbol
+ *
+ * @addr: guest virtual address of the symbol
+ * @name: symbol name
+ */
+struct symbol {
+	uint64_t addr;
+	char *name;
+};
+
+/**
+ * struct symtab - guest symbol table, sorted by address
+ *
+ * @num_syms: number of symbols
+ * @max_syms: number of allocated symbol entries
+ * @sym:      symbols
+ */
+struct symtab {
+	size_t num_syms;
+	size_t max_syms;
+	struct symbol *sym;
+};
+
+/**
+ * symtab_add() - append a symbol to a symbol table
+ *
+ * @tab:  symbol table
+ * @addr: guest virtual address of the symbol
+ * @name: symbol name
+ * @len:  symbol name length
+ *
+ * Return: zero on success, or -1 if an error occurred
+ */
+static int symtab_add(struct symtab *tab, uint64_t addr,
+		      const char *name, size_t len)
+{
+	struct symbol *sym;
+
+	if (tab->num_syms == tab->max_syms) {
+		tab->max_syms = tab->max_syms != 0 ? tab->max_syms * 2 : 64;
+		sym = realloc(tab->sym, tab->max_syms * sizeof(*sym));
+		if (sym == NULL) {
+			error("failed to allocate symbol table");
+			return -1;
+		}
+		tab->sym = sym;
+	}
+
+	sym = &tab->sym[tab->num_syms];
+	sym->addr = addr;
+	sym->name = strndup(name, len);
+	if (sym->name == NULL) {
+		error("failed to allocate symbol name");
+		return -1;
+	}
+
+	tab->num_syms++;
+
+	return 0;
+}
+
+/**
+ * struct elf_file - ELF file being parsed
+ *
+ * @data:      mapped ELF file
+ * @size:      ELF file size
+ * @is64:      non-zero for ELF64 files, zero for ELF32 ones
+ * @shoff:     section header table offset
+ * @shnum:     number of section headers
+ * @shentsize: section header size
+ */
+struct elf_file {
+	const unsigned char *data;
+	size_t size;
+	int is64;
+	uint64_t shoff;
+	unsigned shnum;
+	unsigned shentsize;
+};
+
+/**
+ * struct elf_section - ELF section header fields used by the symbol loader
+ *
+ * @type: section type
+ * @off:  section offset in file
+ * @size: section size
+ * @link: linked section index
+ */
+struct elf_section {
+	unsigned type;
+	uint64_t off;
+	uint64_t size;
+	unsigned link;
+};
+
+/**
+ * elf_get_section() - read a section header of an ELF32 or ELF64 file
+ *
+ * @elf: ELF file
+ * @idx: section index
+ * @sec: where to store section header fields
+ *
+ * Return: zero on success, or -1 if section contents lie outside the file
+ */
+static int elf_get_section(const struct elf_file *elf, unsigned idx,
+			   struct elf_section *sec)
+{
+	const void *sh = elf->data + elf->shoff + (uint64_t) idx * elf->shentsize;
+
+	if (elf->is64) {
+		const Elf64_Shdr *sh64 = sh;
+
+		sec->type = sh64->sh_type;
+		sec->off = sh64->sh_offset;
+		sec->size = sh64->sh_size;
+		sec->link = sh64->sh_link;
+	} else {
+		const Elf32_Shdr *sh32 = sh;
+
+		sec->type = sh32->sh_type;
+		sec->off = sh32->sh_offset;
+		sec->size = sh32->sh_size;
+		sec->link = sh32->sh_link;
+	}
+
+	if (sec->off > elf->size || sec->size > elf->size - sec->off)
+		return -1;
+
+	return 0;
+}
+
+/**
+ * load_elf() - load function symbols from an ELF32 or ELF64 symbol table
+ *
+ * @tab:  symbol table
+ * @data: mapped ELF file
+ * @size: ELF file size
+ *
+ * Return: zero on success, or -1 if an error occurred
+ */
+static int load_elf(struct symtab *tab, const unsigned char *data, size_t size)
+{
+	const Elf64_Ehdr *eh64 = (const void *) data;
+	const Elf32_Ehdr *eh32 = (const void *) data;
+	struct elf_section symsec, strsec;
+	struct elf_file elf;
+	uint32_t name_off;
+	const char *name;
+	unsigned s, type;
+	uint64_t addr, i;
+	size_t entsize;
+
+	elf.data = data;
+	elf.size = size;
+	elf.is64 = data[EI_CLASS] == ELFCLASS64;
+	if (size < (elf.is64 ? sizeof(*eh64) : sizeof(*eh32)))
+		return -1;
+
+	elf.shoff     = elf.is64 ? eh64->e_shoff     : eh32->e_shoff;
+	elf.shnum     = elf.is64 ? eh64->e_shnum     : eh32->e_shnum;
+	elf.shentsize = elf.is64 ? eh64->e_shentsize : eh32->e_shentsize;
+	if (elf.shoff > size ||
+	    (uint64_t) elf.shnum * elf.shentsize > size - elf.shoff)
+		return -1;
+
+	entsize = elf.is64 ? sizeof(Elf64_Sym) : sizeof(Elf32_Sym);
+
+	for (s = 0; s < elf.shnum; s++) {
+		if (elf_get_section(&elf, s, &symsec) != 0 ||
+		    symsec.type != SHT_SYMTAB || symsec.link >= elf.shnum ||
+		    elf_get_section(&elf, symsec.link, &strsec) != 0)
+			continue;
+
+		/* Entry #0 is always the undefined symbol */
+		for (i = 1; i < symsec.size / entsize; i++) {
+			const void *sym = data + symsec.off + i * entsize;
+
+			if (elf.is64) {
+				name_off = ((const Elf64_Sym *) sym)->st_name;
+				addr = ((const Elf64_Sym *) sym)->st_value;
+				type = ELF64_ST_TYPE(((const Elf64_Sym *) sym)->st_info);
+			} else {
+				name_off = ((const Elf32_Sym *) sym)->st_name;
+				addr = ((const Elf32_Sym *) sym)->st_value;
+				type = ELF32_ST_TYPE(((const Elf32_Sym *) sym)->st_info);
+			}
+
+			if ((type != STT_FUNC && type != STT_NOTYPE) ||
+			    name_off == 0 || name_off >= strsec.size)
+				continue;
+
+			name = (const char *) data + strsec.off + name_off;
+			if (symtab_add(tab, addr, name,
+				       strnlen(name, strsec.size - name_off)) != 0)
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * load_map() - load symbols from a map file
+ *
+ * Each line holds a hexadecimal address, an optional single character
+ * symbol type and a symbol name, as printed by nm(1).
+ *
+ * @tab:  symbol table
+ * @map:  mapped map file
+ * @size: map file size
+ *
+ * Return: zero on success, or -1 if an error occurred
+ */
+static int load_map(struct symtab *tab, const char *map, size_t size)
+{
+	const char *p = map, *end = map + size, *eol, *name;
+	uint64_t addr;
+	int digits;
+
+	for (/* NOTHING */; p < end; p = eol + 1) {
+		eol = memchr(p, '\n', end - p);
+		if (eol == NULL)
+			eol = end;
+
+		for (addr = 0, digits = 0; p < eol && isxdigit(*p); p++) {
+			addr = addr << 4 |
+			    (isdigit(*p) ? *p - '0' : (tolower(*p) - 'a' + 10));
+			digits++;
+		}
+		if (digits == 0 || p == eol || !isblank(*p))
+			continue;
+
+		while (p < eol && isblank(*p))
+			p++;
+
+		/* Skip symbol type, if any */
+		if (eol - p > 2 && isalpha(p[0]) && isblank(p[1]))
+			for (p += 2; p < eol && isblank(*p); p++)
+				/* NOTHING */;
+
+		for (name = p; p < eol && !isspace(*p); p++)
+			/* NOTHING */;
+
+		if (p > name && symtab_add(tab, addr, name, p - name) != 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * compare_symbols() - qsort(3) comparator ordering symbols by address
+ *
+ * @a: first symbol
+ * @b: second symbol
+ *
+ * Return: negative, zero or positive value as required by qsort(3)
+ */
+static int compare_symbols(const void *a, const void *b)
+{
+	const struct symbol *x = a, *y = b;
+
+	return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+/**
+ * symtab_load() - load guest symbols from an ELF or a map file
+ *
+ * @path: path to an ELF or a map file
+ *
+ * Return: symbol table, or NULL if an error occurred
+ */
+struct symtab *symtab_load(const char *path)
+{
+	struct symtab *tab;
+	struct stat st;
+	void *data;
+	int ret = -1;
+	int fd;
+
+	assert(path != NULL);
+
+	tab = calloc(1, sizeof(*tab));
+	if (tab == NULL) {
+		error("failed to allocate symbol table");
+		return NULL;
+	}
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		error("%s", path);
+		goto out;
+	}
+
+	data = MAP_FAILED;
+	if (st.st_size > 0)
+		data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED) {
+		error("%s", path);
+		goto out;
+	}
+
+	if (st.st_size >= SELFMAG && memcmp(data, ELFMAG, SELFMAG) == 0)
+		ret = load_elf(tab, data, st.st_size);
+	else
+		ret = load_map(tab, data, st.st_size);
+
+	munmap(data, st.st_size);
+
+	if (ret == 0)
+		qsort(tab->sym, tab->num_syms, sizeof(*tab->sym),
+		      compare_symbols);
+	else
+		errorx("%s: malformed symbol file", path);
+
+out:
+	if (fd >= 0)
+		close(fd);
+
+	if (ret != 0) {
+		symtab_free(tab);
+		return NULL;
+	}
+
+	return tab;
+}
+
+/**
+ * symtab_lookup() - find a symbol containing a guest virtual address
+ *
+ * @tab:    symbol table
+ * @addr:   guest virtual address
+ * @offset: where to store offset of the address from the symbol, or NULL
+ *
+ * Return: name of the closest symbol at or below addr, or NULL if none
+ */
+const char *symtab_lookup(const struct symtab *tab, uint64_t addr,
+			  uint64_t *offset)
+{
+	size_t lo = 0, hi, mid;
+
+	assert(tab != NULL);
+
+	/* Find the first symbol above addr */
+	for (hi = tab->num_syms; lo < hi; /* NOTHING */) {
+		mid = lo + (hi - lo) / 2;
+		if (tab->sym[mid].addr <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo == 0)
+		return NULL;
+
+	if (offset != NULL)
+		*offset = addr - tab->sym[lo - 1].addr;
+
+	return tab->sym[lo - 1].name;
+}
+
+/**
+ * symtab_free() - release a symbol table
+ *
+ * @tab: symbol table
+ */
+void symtab_free(struct symtab *tab)
+{
+	size_t i;
+
+	assert(tab != NULL);
+
+	for (i = 0; i < tab->num_syms; i++)
+		free(tab->sym[i].name);
+
+	free(tab->sym);
+	free(tab);
+}
@@ -0,0 +1,12 @@
+#ifndef _SYMBOL_H
+#define _SYMBOL_H
+
+#include <stdint.h>
+
+struct symtab;
+
+struct symtab *symtab_load(const char *);
+const char *symtab_lookup(const struct symtab *, uint64_t, uint64_t *);
+void symtab_free(struct symtab *);
+
+#endif /* _SYMBOL_H */
@@ -0,0 +1,436 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include <linux/kvm.h>
+
+#include "log.h"
+#include "trace.h"
+
+/**
+ * enum
+ *
+ * @TOP_ADDRESSES: number of most frequent exit addresses to summarize
+ * @GAP_BUCKETS:   number of power of two inter-exit gap histogram buckets
+ * @BURST_WINDOW:  window used to find exit bursts, in nanoseconds
+ */
+enum {
+	TOP_ADDRESSES = 10,
+	GAP_BUCKETS   = 40,
+	BURST_WINDOW  = 1000000,
+};
+
+/**
+ * struct site - exit address statistics
+ *
+ * @reason: KVM_EXIT_* exit reason
+ * @addr:   port number or MMIO guest physical address
+ * @flags:  TRACE_* record flags
+ * @count:  number of exits
+ */
+struct site {
+	uint16_t reason;
+	uint64_t addr;
+	uint8_t flags;
+	uint64_t count;
+};
+
+/*
+ * Names of KVM_EXIT_* exit reasons
+ */
+static const char *const reason_names[] = {
+	[KVM_EXIT_UNKNOWN]         = "UNKNOWN",
+	[KVM_EXIT_EXCEPTION]       = "EXCEPTION",
+	[KVM_EXIT_IO]              = "IO",
+	[KVM_EXIT_HYPERCALL]       = "HYPERCALL",
+	[KVM_EXIT_DEBUG]           = "DEBUG",
+	[KVM_EXIT_HLT]             = "HLT",
+	[KVM_EXIT_MMIO]            = "MMIO",
+	[KVM_EXIT_IRQ_WINDOW_OPEN] = "IRQ_WINDOW_OPEN",
+	[KVM_EXIT_SHUTDOWN]        = "SHUTDOWN",
+	[KVM_EXIT_FAIL_ENTRY]      = "FAIL_ENTRY",
+	[KVM_EXIT_INTR]            = "INTR",
+	[KVM_EXIT_SET_TPR]         = "SET_TPR",
+	[KVM_EXIT_TPR_ACCESS]      = "TPR_ACCESS",
+	[KVM_EXIT_NMI]             = "NMI",
+	[KVM_EXIT_INTERNAL_ERROR]  = "INTERNAL_ERROR",
+	[KVM_EXIT_OSI]             = "OSI",
+	[KVM_EXIT_PAPR_HCALL]      = "PAPR_HCALL",
+	[KVM_EXIT_WATCHDOG]        = "WATCHDOG",
+	[KVM_EXIT_EPR]             = "EPR",
+	[KVM_EXIT_SYSTEM_EVENT]    = "SYSTEM_EVENT",
+	[KVM_EXIT_IOAPIC_EOI]      = "IOAPIC_EOI",
+	[KVM_EXIT_HYPERV]          = "HYPERV",
+};
+
+/**
+ * reason_name() - get a printable name of an exit reason
+ *
+ * @reason: KVM_EXIT_* exit reason
+ *
+ * Return: exit reason name, or NULL if unknown
+ */
+static const char *reason_name(unsigned reason)
+{
+	if (reason < sizeof(reason_names) / sizeof(*reason_names))
+		return reason_names[reason];
+
+	return NULL;
+}
+
+/**
+ * usage() - print usage information to supplied output stream and exit
+ *
+ * @progname: program name
+ * @stream:   output stream
+ */
+static void NORETURN usage(const char *progname, FILE *stream)
+{
+	assert(progname != NULL);
+	assert(stream != NULL);
+
+	fprintf(stream,
+		"Usage: %s [-h] [-s] TRACE\n"
+		"\n"
+		"  -h  print this help and exit\n"
+		"  -s  only print summary statistics\n",
+		progname);
+
+	exit(stream == stdout ? EXIT_SUCCESS : EXIT_FAILURE);
+	/* NOTREACHED */
+}
+
+/**
+ * load_trace() - read an exit trace file
+ *
+ * @path:    trace file path
+ * @hdr:     where to store trace file header
+ * @num_rec: where to store number of records
+ *
+ * Return: records, or NULL if an error occurred
+ */
+static struct trace_record *load_trace(const char *path,
+				       struct trace_header *hdr,
+				       size_t *num_rec)
+{
+	struct trace_record *rec = NULL, *r;
+	size_t max_rec = 0;
+	FILE *stream;
+
+	stream = fopen(path, "r");
+	if (stream == NULL) {
+		error("%s", path);
+		return NULL;
+	}
+
+	if (fread(hdr, sizeof(*hdr), 1, stream) != 1 ||
+	    memcmp(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic)) != 0 ||
+	    hdr->version != TRACE_VERSION ||
+	    hdr->record_size != sizeof(*rec)) {
+		errorx("%s: not an exit trace file", path);
+		fclose(stream);
+		return NULL;
+	}
+
+	for (*num_rec = 0; /* NOTHING */; (*num_rec)++) {
+		if (*num_rec == max_rec) {
+			max_rec = max_rec != 0 ? max_rec * 2 : 4096;
+			r = realloc(rec, max_rec * sizeof(*rec));
+			if (r == NULL) {
+				error("failed to allocate trace records");
+				free(rec);
+				fclose(stream);
+				return NULL;
+			}
+			rec = r;
+		}
+
+		if (fread(&rec[*num_rec], sizeof(*rec), 1, stream) != 1)
+			break;
+	}
+
+	if (ferror(stream)) {
+		error("%s", path);
+		free(rec);
+		rec = NULL;
+	}
+
+	fclose(stream);
+
+	return rec;
+}
+
+/**
+ * compare_tsc() - qsort(3) comparator ordering records by timestamp
+ *
+ * @a: first record
+ * @b: second record
+ *
+ * Return: negative, zero or positive value as required by qsort(3)
+ */
+static int compare_tsc(const void *a, const void *b)
+{
+	const struct trace_record *x = a, *y = b;
+
+	return (x->tsc > y->tsc) - (x->tsc < y->tsc);
+}
+
+/**
+ * compare_sites() - qsort(3) comparator ordering sites by reason and address
+ *
+ * @a: first site
+ * @b: second site
+ *
+ * Return: negative, zero or positive value as required by qsort(3)
+ */
+static int compare_sites(const void *a, const void *b)
+{
+	const struct site *x = a, *y = b;
+
+	if (x->reason != y->reason)
+		return x->reason - y->reason;
+	if (x->addr != y->addr)
+		return (x->addr > y->addr) - (x->addr < y->addr);
+
+	return x->flags - y->flags;
+}
+
+/**
+ * compare_counts() - qsort(3) comparator ordering sites by exit count, most
+ *                    frequent first
+ *
+ * @a: first site
+ * @b: second site
+ *
+ * Return: negative, zero or positive value as required by qsort(3)
+ */
+static int compare_counts(const void *a, const void *b)
+{
+	const struct site *x = a, *y = b;
+
+	return (x->count < y->count) - (x->count > y->count);
+}
+
+/**
+ * to_ns() - convert a timestamp counter delta to nanoseconds
+ *
+ * @hdr:   trace file header
+ * @ticks: timestamp counter delta
+ *
+ * Return: nanoseconds, or ticks if timestamp counter frequency is unknown
+ */
+static double to_ns(const struct trace_header *hdr, uint64_t ticks)
+{
+	return hdr->tsc_khz != 0 ? ticks * 1e6 / hdr->tsc_khz : ticks;
+}
+
+/**
+ * print_reason() - print exit reason
+ *
+ * @stream: output stream
+ * @reason: KVM_EXIT_* exit reason
+ */
+static void print_reason(FILE *stream, unsigned reason)
+{
+	const char *name = reason_name(reason);
+
+	if (name != NULL)
+		fprintf(stream, "%-10s", name);
+	else
+		fprintf(stream, "%-10u", reason);
+}
+
+/**
+ * print_site() - print exit reason, address and access direction
+ *
+ * @stream: output stream
+ * @reason: KVM_EXIT_* exit reason
+ * @addr:   port number or MMIO guest physical address
+ * @flags:  TRACE_* record flags
+ */
+static void print_site(FILE *stream, unsigned reason, uint64_t addr,
+		       unsigned flags)
+{
+	print_reason(stream, reason);
+
+	if (reason == KVM_EXIT_IO || reason == KVM_EXIT_MMIO)
+		fprintf(stream, " %-5s 0x%" PRIx64,
+			(flags & TRACE_WRITE) != 0 ? "write" : "read", addr);
+}
+
+/**
+ * print_records() - print records one per line
+ *
+ * @hdr:     trace file header
+ * @rec:     records, sorted by timestamp
+ * @num_rec: number of records
+ */
+static void print_records(const struct trace_header *hdr,
+			  const struct trace_record *rec, size_t num_rec)
+{
+	size_t i;
+
+	for (i = 0; i < num_rec; i++) {
+		printf("%14.3f vcpu%u rip=0x%08" PRIx64 " ",
+		       to_ns(hdr, rec[i].tsc - rec[0].tsc) / 1000,
+		       rec[i].vcpu, rec[i].rip);
+		print_site(stdout, rec[i].reason, rec[i].addr, rec[i].flags);
+		if (rec[i].size != 0)
+			printf(" size=%u", rec[i].size);
+		putchar('\n');
+	}
+}
+
+/**
+ * print_summary() - print per reason and per address exit counts, exit gap
+ *                   histogram and the densest exit burst
+ *
+ * @hdr:     trace file header
+ * @rec:     records, sorted by timestamp
+ * @num_rec: number of records
+ *
+ * Return: zero on success, or -1 if an error occurred
+ */
+static int print_summary(const struct trace_header *hdr,
+			 const struct trace_record *rec, size_t num_rec)
+{
+	uint64_t gaps[GAP_BUCKETS] = { 0 };
+	uint64_t last_tsc[256] = { 0 };
+	size_t i, j, num_sites, burst = 0, burst_start = 0;
+	double duration, gap;
+	struct site *site;
+	unsigned b;
+
+	duration = num_rec > 0 ? to_ns(hdr, rec[num_rec - 1].tsc - rec[0].tsc) : 0;
+	printf("%zu exits in %.3f ms", num_rec, duration / 1e6);
+	if (duration > 0)
+		printf(", %.0f exits/s", num_rec * 1e9 / duration);
+	printf("%s\n", hdr->tsc_khz == 0 ? " (TSC ticks, unknown rate)" : "");
+
+	site = calloc(num_rec + 1, sizeof(*site));
+	if (site == NULL) {
+		error("failed to allocate exit sites");
+		return -1;
+	}
+
+	for (i = 0; i < num_rec; i++) {
+		site[i].reason = rec[i].reason;
+		site[i].flags = rec[i].flags & TRACE_WRITE;
+		site[i].addr = rec[i].addr;
+		site[i].count = 1;
+	}
+
+	qsort(site, num_rec, sizeof(*site), compare_sites);
+	for (i = 0, num_sites = 0; i < num_rec; i++)
+		if (num_sites > 0 &&
+		    compare_sites(&site[num_sites - 1], &site[i]) == 0)
+			site[num_sites - 1].count++;
+		else
+			site[num_sites++] = site[i];
+
+	/* Sites are ordered by reason here, so reasons are summed in place */
+	printf("\nexits by reason:\n");
+	for (i = 0; i < num_sites; i = j) {
+		uint64_t count = 0;
+
+		for (j = i; j < num_sites && site[j].reason == site[i].reason; j++)
+			count += site[j].count;
+
+		printf("  %10" PRIu64 " %6.2f%%  ", count, 100.0 * count / num_rec);
+		print_reason(stdout, site[i].reason);
+		putchar('\n');
+	}
+
+	qsort(site, num_sites, sizeof(*site), compare_counts);
+	printf("\nmost frequent exit sites:\n");
+	for (i = 0; i < num_sites && i < TOP_ADDRESSES; i++) {
+		printf("  %10" PRIu64 " %6.2f%%  ",
+		       site[i].count, 100.0 * site[i].count / num_rec);
+		print_site(stdout, site[i].reason, site[i].addr, site[i].flags);
+		putchar('\n');
+	}
+
+	free(site);
+
+	/* Gaps between consecutive exits of the same virtual CPU */
+	for (i = 0; i < num_rec; i++) {
+		if (last_tsc[rec[i].vcpu] != 0) {
+			gap = to_ns(hdr, rec[i].tsc - last_tsc[rec[i].vcpu]);
+			for (b = 0; b < GAP_BUCKETS - 1 && gap >= 2ULL << b; b++)
+				/* NOTHING */;
+			gaps[b]++;
+		}
+		last_tsc[rec[i].vcpu] = rec[i].tsc;
+	}
+
+	printf("\ninter-exit gap histogram (%s):\n",
+	       hdr->tsc_khz != 0 ? "ns" : "ticks");
+	for (b = 0; b < GAP_BUCKETS; b++)
+		if (gaps[b] != 0)
+			printf("  < %14llu %10" PRIu64 "\n", 2ULL << b, gaps[b]);
+
+	/* Largest number of exits within any window of BURST_WINDOW */
+	for (i = 0, j = 0; j < num_rec; j++) {
+		while (to_ns(hdr, rec[j].tsc - rec[i].tsc) > BURST_WINDOW)
+			i++;
+		if (j - i + 1 > burst) {
+			burst = j - i + 1;
+			burst_start = i;
+		}
+	}
+
+	if (burst != 0)
+		printf("\ndensest burst: %zu exits within %d us at %.3f us\n",
+		       burst, BURST_WINDOW / 1000,
+		       to_ns(hdr, rec[burst_start].tsc - rec[0].tsc) / 1000);
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct trace_header hdr;
+	struct trace_record *rec;
+	int summary_only = 0;
+	size_t num_rec;
+	int opt, ret;
+
+	while ((opt = getopt(argc, argv, "sh")) != -1)
+		switch (opt) {
+		case 's':
+			summary_only = 1;
+			break;
+		case 'h':
+			/* FALLTHROUGH */
+		default:
+			usage(argv[0], opt == 'h' ? stdout : stderr);
+			/* NOTREACHED */
+		}
+
+	if (argc - optind != 1) {
+		errorx("missing trace file name");
+		usage(argv[0], stderr);
+		/* NOTREACHED */
+	}
+
+	rec = load_trace(argv[optind], &hdr, &num_rec);
+	if (rec == NULL)
+		return EXIT_FAILURE;
+
+	/* Rings of different virtual CPUs are drained independently */
+	qsort(rec, num_rec, sizeof(*rec), compare_tsc);
+
+	if (!summary_only) {
+		print_records(&hdr, rec, num_rec);
+		putchar('\n');
+	}
+
+	ret = print_summary(&hdr, rec, num_rec);
+	free(rec);
+
+	return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,231 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include "bulk.h"
+#include "loader/cimage.h"
+#include "log.h"
+#include "lz.h"
+
+/**
+ * usage() - print usage information to supplied output stream and exit
+ *
+ * @progname: program name
+ * @stream:   output stream
+ */
+static void NORETURN usage(const char *progname, FILE *stream)
+{
+	assert(progname != NULL);
+	assert(stream != NULL);
+
+	fprintf(stream,
+		"Usage: %s [-h] [-b KILOBYTES] IMAGE OUTPUT\n"
+		"\n"
+		"  -h            print this help and exit\n"
+		"  -b KILOBYTES  uncompressed block size, %d by default\n",
+		progname, CIMAGE_BLOCK_SIZE >> 10);
+
+	exit(stream == stdout ? EXIT_SUCCESS : EXIT_FAILURE);
+	/* NOTREACHED */
+}
+
+/**
+ * load_file() - read a whole file into memory
+ *
+ * @path: file path
+ * @size: where to store file size
+ *
+ * Return: file contents, or NULL if an error occurred
+ */
+static uint8_t *load_file(const char *path, size_t *size)
+{
+	uint8_t *data = NULL, *d;
+	size_t max_size = 0, n;
+	FILE *stream;
+
+	stream = fopen(path, "r");
+	if (stream == NULL) {
+		error("%s", path);
+		return NULL;
+	}
+
+	for (*size = 0; /* NOTHING */; *size += n) {
+		if (*size == max_size) {
+			max_size = max_size != 0 ? max_size * 2 : 1 << 20;
+			d = realloc(data, max_size);
+			if (d == NULL) {
+				error("failed to allocate image buffer");
+				free(data);
+				fclose(stream);
+				return NULL;
+			}
+			data = d;
+		}
+
+		n = fread(data + *size, 1, max_size - *size, stream);
+		if (n == 0)
+			break;
+	}
+
+	if (ferror(stream)) {
+		error("%s", path);
+		free(data);
+		data = NULL;
+	}
+
+	fclose(stream);
+
+	return data;
+}
+
+/**
+ * write_image() - compress an image block by block into a compressed image
+ *                 file
+ *
+ * Blocks that do not shrink are stored as is, and all-zero blocks are not
+ * stored at all.
+ *
+ * @path:       output file path
+ * @image:      image contents
+ * @image_size: image size
+ * @block_size: uncompressed block size
+ *
+ * Return: zero on success, or -1 if an error occurred
+ */
+static int write_image(const char *path, const uint8_t *image,
+		       size_t image_size, uint32_t block_size)
+{
+	struct cimage_header hdr;
+	struct cimage_block *block;
+	unsigned num_zero = 0, num_raw = 0;
+	uint64_t offset;
+	size_t i, len;
+	uint8_t *buf;
+	FILE *stream;
+	int ret = -1;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CIMAGE_MAGIC, sizeof(hdr.magic));
+	hdr.block_size = block_size;
+	hdr.num_blocks = (image_size + block_size - 1) / block_size;
+	hdr.image_size = image_size;
+
+	block = calloc(hdr.num_blocks, sizeof(*block));
+	buf = malloc(block_size);
+	if (block == NULL || buf == NULL) {
+		error("failed to allocate compression buffers");
+		goto out;
+	}
+
+	stream = fopen(path, "w");
+	if (stream == NULL) {
+		error("%s", path);
+		goto out;
+	}
+
+	/* Index is written once block offsets are known */
+	offset = sizeof(hdr) + hdr.num_blocks * sizeof(*block);
+	if (fseek(stream, offset, SEEK_SET) != 0)
+		goto err;
+
+	for (i = 0; i < hdr.num_blocks; i++) {
+		const uint8_t *data = image + i * block_size;
+
+		len = image_size - i * block_size < block_size ?
+		    image_size - i * block_size : block_size;
+
+		if (bulk_is_zero(data, len)) {
+			block[i].type = CIMAGE_BLOCK_ZERO;
+			num_zero++;
+			continue;
+		}
+
+		block[i].offset = offset;
+		block[i].size = lz_compress(data, len, buf, len - 1);
+		block[i].type = CIMAGE_BLOCK_LZ;
+		if (block[i].size == 0) {
+			block[i].size = len;
+			block[i].type = CIMAGE_BLOCK_RAW;
+			num_raw++;
+		}
+
+		if (fwrite(block[i].type == CIMAGE_BLOCK_RAW ? data : buf,
+			   block[i].size, 1, stream) != 1)
+			goto err;
+		offset += block[i].size;
+	}
+
+	if (fseek(stream, 0, SEEK_SET) != 0 ||
+	    fwrite(&hdr, sizeof(hdr), 1, stream) != 1 ||
+	    fwrite(block, sizeof(*block), hdr.num_blocks, stream) !=
+	    hdr.num_blocks)
+		goto err;
+
+	if (fclose(stream) != 0) {
+		error("%s", path);
+		goto out;
+	}
+
+	printf("%s: %zu KiB -> %" PRIu64 " KiB (%.1f%%), %u blocks, "
+	       "%u zero, %u stored\n", path, image_size >> 10, offset >> 10,
+	       image_size > 0 ? 100.0 * offset / image_size : 0,
+	       hdr.num_blocks, num_zero, num_raw);
+
+	ret = 0;
+	goto out;
+
+err:
+	error("%s", path);
+	fclose(stream);
+out:
+	free(buf);
+	free(block);
+
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long block_size = CIMAGE_BLOCK_SIZE;
+	char *endptr;
+	uint8_t *image;
+	size_t size;
+	int opt, ret;
+
+	while ((opt = getopt(argc, argv, "b:h")) != -1)
+		switch (opt) {
+		case 'b':
+			block_size = strtoul(optarg, &endptr, 10) << 10;
+			if (*endptr != '\0' || block_size == 0 ||
+			    block_size > CIMAGE_MAX_BLOCK_SIZE) {
+				errorx("%s: wrong block size", optarg);
+				usage(argv[0], stderr);
+				/* NOTREACHED */
+			}
+			break;
+		case 'h':
+			/* FALLTHROUGH */
+		default:
+			usage(argv[0], opt == 'h' ? stdout : stderr);
+			/* NOTREACHED */
+		}
+
+	if (argc - optind != 2) {
+		errorx("missing image or output file name");
+		usage(argv[0], stderr);
+		/* NOTREACHED */
+	}
+
+	image = load_file(argv[optind], &size);
+	if (image == NULL)
+		return EXIT_FAILURE;
+
+	ret = write_image(argv[optind + 1], image, size, block_size);
+	free(image);
+
+	return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,156 @@
+#!/bin/sh
+#
+# Run guest workloads under a set of kvmapp option sets and tabulate the
+# median of each result, one column per option set.
+#
+# Guests report "NAME COUNT UNIT NANOSECONDS ns" lines on the console,
+# shown as MB/s for bytes, ns per load for loads and millions per second
+# for anything else. Run from the top of the tree once guests are built.
+
+KVMAPP=./kvmapp
+MEMORY=64
+RUNS=3
+TIMEOUT=600
+CONFIGS=
+GUESTS="guest/stream_guest.bin guest/chase_guest.bin guest/compute_guest.bin"
+
+usage() {
+	cat <<EOF
+Usage: $0 [-h] [-k KVMAPP] [-m MEGABYTES] [-r RUNS] [-t SECONDS]
+       [-c OPTIONS]... [GUEST]...
+
+  -h            print this help and exit
+  -k KVMAPP     kvmapp binary, $KVMAPP by default
+  -m MEGABYTES  guest memory size, $MEMORY by default, at least 20 for
+                stream_guest and 40 for chase_guest
+  -r RUNS       runs per guest and option set, $RUNS by default
+  -t SECONDS    time limit per run, $TIMEOUT by default
+  -c OPTIONS    kvmapp option set to compare, may be repeated, host
+                defaults, 4k, THP and reserved huge pages, preallocated
+                memory and a pinned VCPU by default
+EOF
+	exit $1
+}
+
+while getopts "c:hk:m:r:t:" opt; do
+	case $opt in
+	c) CONFIGS="$CONFIGS$OPTARG
+" ;;
+	h) usage 0 ;;
+	k) KVMAPP=$OPTARG ;;
+	m) MEMORY=$OPTARG ;;
+	r) RUNS=$OPTARG ;;
+	t) TIMEOUT=$OPTARG ;;
+	*) usage 1 >&2 ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+[ $# -gt 0 ] && GUESTS="$*"
+[ -n "$CONFIGS" ] || CONFIGS="
+--pages=4k
+--pages=thp
+--pages=hugetlb
+--prealloc
+--cpu=0
+"
+
+RESULTS=$(mktemp) || exit 1
+trap 'rm -f "$RESULTS"' EXIT
+
+# One "COLUMN CONFIG NAME UNIT COUNT NS" line per result, tab separated,
+# and one with only COLUMN and CONFIG per option set
+column=0
+printf '%s' "$CONFIGS" | while IFS= read -r config; do
+	column=$((column + 1))
+	printf '%d\t%s\t\t\t\t\n' $column "${config:-default}" >>"$RESULTS"
+	for guest in $GUESTS; do
+		run=0
+		while [ $run -lt "$RUNS" ]; do
+			run=$((run + 1))
+			printf '%s %s run %d/%d\n' "${config:-default}" \
+			    "$guest" $run "$RUNS" >&2
+			# Results reported before a failure still count
+			# shellcheck disable=SC2086
+			output=$(timeout "$TIMEOUT" "$KVMAPP" -m "$MEMORY" \
+			    $config "$guest" </dev/null)
+			status=$?
+			echo "$output" | awk -v c=$column \
+			    -v cfg="${config:-default}" \
+			    'NF == 5 && $5 == "ns" && $2 ~ /^[0-9]+$/ &&
+			     $4 ~ /^[0-9]+$/ {
+				print c "\t" cfg "\t" $1 "\t" $3 "\t" $2 "\t" $4
+			    }' >>"$RESULTS"
+			if [ $status -ne 0 ]; then
+				printf '%s: %s failed\n' "$guest" \
+				    "${config:-default}" >&2
+				break
+			fi
+		done
+	done
+done
+
+# Median of every result, then a row per workload in reporting order and
+# a column per option set
+sort -t '	' -k1,1n -k3,3 -k6,6n "$RESULTS" | awk -F '\t' '
+function flush() {
+	if (n == 0)
+		return
+	v = ns[int((n + 1) / 2)]
+	if (unit == "bytes")
+		value[key] = sprintf("%.1f", count * 1000 / v)
+	else if (unit == "loads")
+		value[key] = sprintf("%.2f", v / count)
+	else
+		value[key] = sprintf("%.2f", count * 1000 / v)
+	n = 0
+}
+
+NR == FNR {
+	if (!($1 in config)) {
+		config[$1] = $2
+		if ($1 > columns)
+			columns = $1
+	}
+	if ($3 != "" && !($3 in metric)) {
+		if ($4 == "bytes")
+			metric[$3] = "MB/s"
+		else if ($4 == "loads")
+			metric[$3] = "ns/load"
+		else
+			metric[$3] = "M" $4 "/s"
+		rows[++num_rows] = $3
+	}
+	next
+}
+
+$3 != "" {
+	k = $1 SUBSEP $3
+	if (k != key)
+		flush()
+	key = k
+	unit = $4
+	count = $5
+	ns[++n] = $6
+}
+
+END {
+	flush()
+
+	printf "%-16s %-16s", "workload", "metric"
+	for (c = 1; c <= columns; c++)
+		if (c in config)
+			printf " %16s", config[c]
+	printf "\n"
+
+	for (r = 1; r <= num_rows; r++) {
+		printf "%-16s %-16s", rows[r], metric[rows[r]]
+		for (c = 1; c <= columns; c++) {
+			if (!(c in config))
+				continue
+			k = c SUBSEP rows[r]
+			printf " %16s", k in value ? value[k] : "-"
+		}
+		printf "\n"
+	}
+}' "$RESULTS" -
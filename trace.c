@@ -0,0 +1,315 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <pthread.h>
+#include <x86intrin.h>
+
+#include <linux/kvm.h>
+
+#include "kvm.h"
+#include "kvmapp.h"
+#include "log.h"
+#include "trace.h"
+
+/**
+ * enum
+ *
+ * @RING_SIZE:     number of records in a per virtual CPU ring, a power of two
+ * @WRITER_SLEEP:  writer thread idle sleep in nanoseconds
+ * @STREAM_BUFFER: trace file stream buffer size
+ */
+enum {
+	RING_SIZE     = 1 << 16,
+	WRITER_SLEEP  = 1000000,
+	STREAM_BUFFER = 1 << 20,
+};
+
+/**
+ * struct ring - single producer, single consumer ring of exit records
+ *
+ * Indices grow monotonically and are masked on access. The virtual CPU
+ * thread only advances @head and the writer thread only advances @tail,
+ * so the ring needs no locks.
+ *
+ * @head:    index of the next record to produce
+ * @dropped: number of records dropped because the ring was full
+ * @tail:    index of the next record to consume
+ * @rec:     records
+ */
+struct ring {
+	uint64_t head ALIGNED(CACHE_LINE_SIZE);
+	uint64_t dropped;
+	uint64_t tail ALIGNED(CACHE_LINE_SIZE);
+	struct trace_record rec[RING_SIZE] ALIGNED(CACHE_LINE_SIZE);
+};
+
+/**
+ * struct trace - exit trace recorder
+ *
+ * @vm:       traced virtual machine
+ * @path:     trace file path
+ * @stream:   trace file stream
+ * @writer:   writer thread
+ * @stop:     non-zero once the writer thread should finish
+ * @failed:   non-zero if writing trace file failed
+ * @tsc0:     timestamp counter value at trace start
+ * @ns0:      monotonic time at trace start
+ * @ring:     per virtual CPU record rings
+ */
+struct trace {
+	struct vm *vm;
+	const char *path;
+	FILE *stream;
+	pthread_t writer;
+	int stop;
+	int failed;
+	uint64_t tsc0;
+	uint64_t ns0;
+	struct ring ring[MAX_VCPUS];
+};
+
+/**
+ * monotonic_ns() - read monotonic clock
+ *
+ * Return: monotonic time in nanoseconds
+ */
+static uint64_t monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * drain() - write all pending records to the trace file
+ *
+ * @t: exit trace recorder
+ *
+ * Return: number of written records
+ */
+static size_t drain(struct trace *t)
+{
+	uint64_t head, tail, n;
+	size_t total = 0;
+	struct ring *r;
+
+	for (r = t->ring; r < t->ring + MAX_VCPUS; r++) {
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		total += head - r->tail;
+
+		for (tail = r->tail; tail != head; tail += n) {
+			/* Write up to the end of the ring at once */
+			n = head - tail;
+			if (n > RING_SIZE - (tail & (RING_SIZE - 1)))
+				n = RING_SIZE - (tail & (RING_SIZE - 1));
+
+			if (!t->failed &&
+			    fwrite(&r->rec[tail & (RING_SIZE - 1)],
+				   sizeof(*r->rec), n, t->stream) != n) {
+				error("%s", t->path);
+				t->failed = 1;
+			}
+		}
+
+		__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+	}
+
+	return total;
+}
+
+/**
+ * writer_thread() - stream records to the trace file until stopped
+ *
+ * @arg: exit trace recorder
+ *
+ * Return: NULL
+ */
+static void *writer_thread(void *arg)
+{
+	const struct timespec idle = { 0, WRITER_SLEEP };
+	struct trace *t = arg;
+
+	while (!__atomic_load_n(&t->stop, __ATOMIC_ACQUIRE))
+		if (drain(t) == 0)
+			nanosleep(&idle, NULL);
+
+	drain(t);
+
+	return NULL;
+}
+
+/**
+ * trace_create() - start recording virtual machine exits into a file
+ *
+ * @vm:   virtual machine to trace
+ * @path: trace file path
+ *
+ * Return: exit trace recorder, or NULL if an error occurred
+ */
+struct trace *trace_create(struct vm *vm, const char *path)
+{
+	struct trace_header hdr;
+	struct trace *t;
+
+	assert(vm != NULL);
+	assert(path != NULL);
+
+	t = aligned_alloc(CACHE_LINE_SIZE, sizeof(*t));
+	if (t == NULL) {
+		error("failed to allocate exit trace recorder");
+		return NULL;
+	}
+
+	memset(t, 0, sizeof(*t));
+	t->vm = vm;
+	t->path = path;
+
+	t->stream = fopen(path, "w");
+	if (t->stream == NULL) {
+		error("%s", path);
+		free(t);
+		return NULL;
+	}
+
+	setvbuf(t->stream, NULL, _IOFBF, STREAM_BUFFER);
+
+	/*
+	 * Frequency is only known at the end and patched in then, until which
+	 * the file reads as a trace of unknown rate
+	 */
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+	hdr.version = TRACE_VERSION;
+	hdr.record_size = sizeof(struct trace_record);
+	if (fwrite(&hdr, sizeof(hdr), 1, t->stream) != 1 ||
+	    fflush(t->stream) != 0) {
+		error("%s", path);
+		goto err;
+	}
+
+	t->ns0 = monotonic_ns();
+	t->tsc0 = __rdtsc();
+
+	if (pthread_create(&t->writer, NULL, writer_thread, t) != 0) {
+		errorx("failed to start exit trace writer");
+		goto err;
+	}
+
+	return t;
+
+err:
+	fclose(t->stream);
+	free(t);
+	return NULL;
+}
+
+/**
+ * trace_exit() - record a virtual machine exit
+ *
+ * Called by the thread running the virtual CPU right after KVM_RUN. If the
+ * ring is full the record is dropped rather than stalling the guest.
+ *
+ * @t:    exit trace recorder
+ * @vcpu: virtual CPU identifier
+ * @run:  virtual CPU parameter block
+ */
+void trace_exit(struct trace *t, unsigned vcpu, const struct kvm_run *run)
+{
+	struct trace_record *rec;
+	struct kvm_regs regs;
+	struct ring *r;
+	uint64_t head;
+
+	assert(t != NULL);
+	assert(vcpu < MAX_VCPUS);
+	assert(run != NULL);
+
+	r = &t->ring[vcpu];
+	head = r->head;
+	if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == RING_SIZE) {
+		r->dropped++;
+		return;
+	}
+
+	rec = &r->rec[head & (RING_SIZE - 1)];
+	memset(rec, 0, sizeof(*rec));
+	rec->tsc = __rdtsc();
+	rec->reason = run->exit_reason;
+	rec->vcpu = vcpu;
+
+	switch (run->exit_reason) {
+	case KVM_EXIT_IO:
+		rec->addr = run->io.port;
+		rec->size = run->io.size;
+		if (run->io.direction == KVM_EXIT_IO_OUT)
+			rec->flags |= TRACE_WRITE;
+		break;
+	case KVM_EXIT_MMIO:
+		rec->addr = run->mmio.phys_addr;
+		rec->size = run->mmio.len;
+		if (run->mmio.is_write)
+			rec->flags |= TRACE_WRITE;
+		break;
+	}
+
+	/* Served from the kvm_run register mirror, without an ioctl */
+	if (vcpu_get_regs(t->vm, vcpu, &regs) == 0)
+		rec->rip = regs.rip;
+
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * trace_destroy() - flush pending records and close a trace file
+ *
+ * @t: exit trace recorder
+ *
+ * Return: zero on success, or -1 if the trace file is incomplete
+ */
+int trace_destroy(struct trace *t)
+{
+	uint64_t dropped = 0;
+	uint64_t tsc, ns, tsc_khz = 0;
+	unsigned i;
+
+	assert(t != NULL);
+
+	__atomic_store_n(&t->stop, 1, __ATOMIC_RELEASE);
+	pthread_join(t->writer, NULL);
+
+	tsc = __rdtsc();
+	ns = monotonic_ns();
+
+	if (ns > t->ns0)
+		tsc_khz = (double) (tsc - t->tsc0) * 1000000 / (ns - t->ns0);
+
+	if (fseek(t->stream, offsetof(struct trace_header, tsc_khz),
+		  SEEK_SET) != 0 ||
+	    fwrite(&tsc_khz, sizeof(tsc_khz), 1, t->stream) != 1) {
+		error("%s", t->path);
+		t->failed = 1;
+	}
+
+	if (fclose(t->stream) != 0) {
+		error("%s", t->path);
+		t->failed = 1;
+	}
+
+	for (i = 0; i < MAX_VCPUS; i++)
+		dropped += t->ring[i].dropped;
+	if (dropped != 0)
+		errorx("%s: %" PRIu64 " exit records dropped",
+		       t->path, dropped);
+
+	i = t->failed;
+	free(t);
+
+	return i ? -1 : 0;
+}
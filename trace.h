@@ -0,0 +1,68 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdint.h>
+
+struct kvm_run;
+struct trace;
+struct vm;
+
+/**
+ * TRACE_MAGIC - exit trace file signature
+ */
+#define TRACE_MAGIC "KVMTRACE"
+
+/**
+ * enum
+ *
+ * @TRACE_VERSION: exit trace file format version
+ * @TRACE_WRITE:   record flag of a guest write (port OUT or MMIO write)
+ */
+enum {
+	TRACE_VERSION = 1,
+	TRACE_WRITE   = 1 << 0,
+};
+
+/**
+ * struct trace_header - exit trace file header, followed by records
+ *
+ * @magic:       TRACE_MAGIC
+ * @version:     TRACE_VERSION
+ * @record_size: size of a single record
+ * @tsc_khz:     timestamp counter frequency in kHz, or zero if unknown
+ */
+struct trace_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint64_t tsc_khz;
+};
+
+/**
+ * struct trace_record - single virtual machine exit
+ *
+ * @tsc:    host timestamp counter value right after the exit
+ * @rip:    guest instruction pointer
+ * @addr:   port number or MMIO guest physical address, zero otherwise
+ * @reason: KVM_EXIT_* exit reason
+ * @vcpu:   virtual CPU identifier
+ * @size:   port or MMIO access size in bytes
+ * @flags:  TRACE_* record flags
+ * @pad:    reserved, zero
+ */
+struct trace_record {
+	uint64_t tsc;
+	uint64_t rip;
+	uint64_t addr;
+	uint16_t reason;
+	uint8_t vcpu;
+	uint8_t size;
+	uint8_t flags;
+	uint8_t pad[3];
+};
+
+struct trace *trace_create(struct vm *, const char *);
+void trace_exit(struct trace *, unsigned, const struct kvm_run *);
+int trace_destroy(struct trace *);
+
+#endif /* _TRACE_H */
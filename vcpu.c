@@ -1,3 +1,6 @@
+#include <assert.h>
+#include <string.h>
+
 #include <sys/user.h>
 
 #include <linux/kvm.h>
@@ -6,23 +9,75 @@
 #include "log.h"
 #include "vcpu.h"
 
+/*
+ * Model specific registers saved on top of register sets, the only state
+ * of the paravirtual devices a guest may have enabled
+ */
+const uint32_t vcpu_msrs[VCPU_NUM_MSRS] = {
+	MSR_KVM_SYSTEM_TIME_NEW,
+};
+
 /**
  * enum
  *
- * @CR0_PE:  protected mode enable
- * @CR0_PG:  paging mode enable
- * @CR4_PSE: page size extension enable
+ * @CR0_PE:         protected mode enable
+ * @CR0_MP:         monitor coprocessor
+ * @CR0_EM:         x87 emulation
+ * @CR0_PG:         paging mode enable
+ * @CR4_PSE:        page size extension enable
+ * @CR4_OSFXSR:     FXSAVE/FXRSTOR and SSE enable
+ * @CR4_OSXMMEXCPT: unmasked SIMD floating-point exceptions enable
+ * @CR4_OSXSAVE:    XSAVE and extended states enable
+ *
+ * @CPUID_FEATURES:      feature information leaf
+ * @CPUID_EXTENDED:      structured extended feature flags leaf
+ * @CPUID_XSTATE:        processor extended state enumeration leaf
+ * @CPUID_1_EDX_FXSR:    FXSAVE/FXRSTOR support
+ * @CPUID_1_ECX_XSAVE:   XSAVE support
+ * @CPUID_1_ECX_AVX:     AVX support
+ * @CPUID_7_EBX_AVX512F: AVX-512 foundation support
  *
- * @PDE_P:   page directory entry present bit
- * @PDE_RW:  page directory entry read/write bit
- * @PDE_S:   page directory entry supervisor bit
- * @PDE_PS:  page directory entry page size bit (4MB)
- * @PDE_RWP: same as PDE_RW | PDE_P
+ * @CPUID_KVM_FEATURES:     KVM paravirtual features leaf
+ * @CPUID_KVM_CLOCKSOURCE2: kvmclock at the new MSR numbers support
+ * @KVM_SYSTEM_TIME_ENABLE: kvmclock enable bit in the address MSR
+ *
+ * @XCR0_X87:    x87 state
+ * @XCR0_SSE:    SSE state
+ * @XCR0_AVX:    AVX state
+ * @XCR0_AVX512: AVX-512 opmask, ZMM_Hi256 and Hi16_ZMM states
+ *
+ * @PDE_P:          page directory entry present bit
+ * @PDE_RW:         page directory entry read/write bit
+ * @PDE_S:          page directory entry supervisor bit
+ * @PDE_PS:         page directory entry page size bit (4MB)
+ * @PDE_RWP:        same as PDE_RW | PDE_P
  */
 enum {
-	CR0_PE  = 1UL << 0,
-	CR0_PG  = 1UL << 31,
-	CR4_PSE = 1UL << 4,
+	CR0_PE         = 1UL << 0,
+	CR0_MP         = 1UL << 1,
+	CR0_EM         = 1UL << 2,
+	CR0_PG         = 1UL << 31,
+	CR4_PSE        = 1UL << 4,
+	CR4_OSFXSR     = 1UL << 9,
+	CR4_OSXMMEXCPT = 1UL << 10,
+	CR4_OSXSAVE    = 1UL << 18,
+
+	CPUID_FEATURES      = 0x1,
+	CPUID_EXTENDED      = 0x7,
+	CPUID_XSTATE        = 0xd,
+	CPUID_1_EDX_FXSR    = 1UL << 24,
+	CPUID_1_ECX_XSAVE   = 1UL << 26,
+	CPUID_1_ECX_AVX     = 1UL << 28,
+	CPUID_7_EBX_AVX512F = 1UL << 16,
+
+	CPUID_KVM_FEATURES     = 0x40000001,
+	CPUID_KVM_CLOCKSOURCE2 = 1UL << 3,
+	KVM_SYSTEM_TIME_ENABLE = 1UL << 0,
+
+	XCR0_X87    = 1UL << 0,
+	XCR0_SSE    = 1UL << 1,
+	XCR0_AVX    = 1UL << 2,
+	XCR0_AVX512 = 7UL << 5,
 
 	PDE_P   = 1UL << 0,
 	PDE_RW  = 1UL << 1,
@@ -33,29 +88,133 @@ enum {
 };
 
 /**
- * vcpu_init() - perform common initialization of a virtual CPU
+ * vcpu_state_begin() - start a batched update of virtual CPU state
  *
+ * @state: virtual CPU state to initialize
  * @vm:    virtual machine descriptor
- * @vcpu:  ID of a virtual CPU to initialize
+ * @vcpu:  virtual CPU identifier
+ */
+void vcpu_state_begin(struct vcpu_state *state, struct vm *vm, unsigned vcpu)
+{
+	assert(state != NULL);
+	assert(vm != NULL);
+
+	memset(state, 0, sizeof(*state));
+	state->vm = vm;
+	state->vcpu = vcpu;
+}
+
+/**
+ * vcpu_state_regs() - access general purpose registers of a batched update
+ *
+ * @state: virtual CPU state
+ *
+ * Return: modifiable general purpose registers, or NULL if an error occurred
+ */
+struct kvm_regs *vcpu_state_regs(struct vcpu_state *state)
+{
+	assert(state != NULL);
+
+	if ((state->loaded & VCPU_STATE_REGS) == 0) {
+		if (vcpu_get_regs(state->vm, state->vcpu, &state->regs) != 0)
+			return NULL;
+		state->loaded |= VCPU_STATE_REGS;
+	}
+
+	return &state->regs;
+}
+
+/**
+ * vcpu_state_sregs() - access special registers of a batched update
+ *
+ * @state: virtual CPU state
+ *
+ * Return: modifiable special registers, or NULL if an error occurred
+ */
+struct kvm_sregs *vcpu_state_sregs(struct vcpu_state *state)
+{
+	assert(state != NULL);
+
+	if ((state->loaded & VCPU_STATE_SREGS) == 0) {
+		if (vcpu_get_sregs(state->vm, state->vcpu, &state->sregs) != 0)
+			return NULL;
+		state->loaded |= VCPU_STATE_SREGS;
+	}
+
+	return &state->sregs;
+}
+
+/**
+ * vcpu_state_xcrs() - access extended control registers of a batched update
+ *
+ * @state: virtual CPU state
+ *
+ * Return: modifiable extended control registers, or NULL if an error occurred
+ */
+struct kvm_xcrs *vcpu_state_xcrs(struct vcpu_state *state)
+{
+	assert(state != NULL);
+
+	if ((state->loaded & VCPU_STATE_XCRS) == 0) {
+		if (vcpu_get_xcrs(state->vm, state->vcpu, &state->xcrs) != 0)
+			return NULL;
+		state->loaded |= VCPU_STATE_XCRS;
+	}
+
+	return &state->xcrs;
+}
+
+/**
+ * vcpu_state_commit() - write accessed register sets back into a virtual CPU
+ *
+ * @state: virtual CPU state
+ *
+ * Return: zero on success, or -1 if an error occurred
+ */
+int vcpu_state_commit(struct vcpu_state *state)
+{
+	assert(state != NULL);
+
+	if ((state->loaded & VCPU_STATE_SREGS) != 0 &&
+	    vcpu_set_sregs(state->vm, state->vcpu, &state->sregs) != 0)
+		return -1;
+
+	if ((state->loaded & VCPU_STATE_XCRS) != 0 &&
+	    vcpu_set_xcrs(state->vm, state->vcpu, &state->xcrs) != 0)
+		return -1;
+
+	if ((state->loaded & VCPU_STATE_REGS) != 0 &&
+	    vcpu_set_regs(state->vm, state->vcpu, &state->regs) != 0)
+		return -1;
+
+	state->loaded = 0;
+
+	return 0;
+}
+
+/**
+ * vcpu_init() - perform common initialization of a virtual CPU
+ *
+ * @state: virtual CPU state to initialize
  * @entry: guest physical entry point (RIP value)
  * @stack: guest physical stack top (RSP value)
  *
  * Return: zero on success, or -1 if an error occurred
  */
-int vcpu_init(struct vm *vm, unsigned vcpu, uintptr_t entry, uintptr_t stack)
+int vcpu_init(struct vcpu_state *state, uintptr_t entry, uintptr_t stack)
 {
-	struct kvm_regs regs;
+	struct kvm_regs *regs;
 
-	if (vcpu_get_regs(vm, vcpu, &regs) == 0) {
-		regs.rflags = 0x2;
-		regs.rip = entry;
-		regs.rsp = stack;
+	regs = vcpu_state_regs(state);
+	if (regs != NULL) {
+		regs->rflags = 0x2;
+		regs->rip = entry;
+		regs->rsp = stack;
 
-		if (vcpu_set_regs(vm, vcpu, &regs) == 0)
-			return 0;
+		return 0;
 	}
 
-	errorx("failed to initiazle VCPU #%u", vcpu);
+	errorx("failed to initiazle VCPU #%u", state->vcpu);
 
 	return -1;
 }
@@ -63,28 +222,32 @@ int vcpu_init(struct vm *vm, unsigned vcpu, uintptr_t entry, uintptr_t stack)
 /**
  * vcpu_enable_protected_mode() - enable protected mode on a virtual CPU
  *
- * @vm:   virtual machine descriptor
- * @vcpu: ID of a virtual CPU to enable protected mode on
+ * @state: virtual CPU state to enable protected mode in
  *
  * Return: zero on success, or -1 if an error occurred
  */
-int vcpu_enable_protected_mode(struct vm *vm, unsigned vcpu)
+int vcpu_enable_protected_mode(struct vcpu_state *state)
 {
-	struct kvm_sregs sregs;
+	struct kvm_sregs *sregs;
 
-	if (vcpu_get_sregs(vm, vcpu, &sregs) == 0) {
-		sregs.cs.base  = sregs.ss.base  = sregs.ds.base  = 0x0;
-		sregs.cs.limit = sregs.ss.limit = sregs.ds.limit = 0xffffffff;
-		sregs.cs.g     = sregs.ss.g     = sregs.ds.g     = 1;
-		sregs.cs.db    = sregs.ss.db                     = 1;
+	sregs = vcpu_state_sregs(state);
+	if (sregs != NULL) {
+		sregs->cs.base  = sregs->ss.base  = sregs->ds.base  = 0x0;
+		sregs->cs.limit = sregs->ss.limit = sregs->ds.limit = 0xffffffff;
+		sregs->cs.g     = sregs->ss.g     = sregs->ds.g     = 1;
+		sregs->cs.db    = sregs->ss.db                      = 1;
 
-		sregs.cr0 |= CR0_PE;
+		/* String instructions store through ES */
+		sregs->es.base  = sregs->fs.base  = sregs->gs.base  = 0x0;
+		sregs->es.limit = sregs->fs.limit = sregs->gs.limit = 0xffffffff;
+		sregs->es.g     = sregs->fs.g     = sregs->gs.g     = 1;
 
-		if (vcpu_set_sregs(vm, vcpu, &sregs) == 0)
-			return 0;
+		sregs->cr0 |= CR0_PE;
+
+		return 0;
 	}
 
-	errorx("failed to enable protected mode on VCPU #%u", vcpu);
+	errorx("failed to enable protected mode on VCPU #%u", state->vcpu);
 
 	return -1;
 }
@@ -92,35 +255,213 @@ int vcpu_enable_protected_mode(struct vm *vm, unsigned vcpu)
 /**
  * vcpu_enable_paged_mode() - enabled paged mode on a virtual CPU
  *
- * @vm:   virtual machine descriptor
- * @vcpu: ID of a virtual CPU to enable paged mode on
- * @pdir: guest physical address for an identity page directory
+ * @state: virtual CPU state to enable paged mode in
+ * @pdir:  guest physical address for an identity page directory
  *
  * Return: zero on success, or -1 if an error occurred
  */
-int vcpu_enable_paged_mode(struct vm *vm, unsigned vcpu, uintptr_t pdir)
+int vcpu_enable_paged_mode(struct vcpu_state *state, uintptr_t pdir)
 {
-	struct kvm_sregs sregs;
+	struct kvm_sregs *sregs;
 	uint32_t *pd;
 	int i;
 
-	if (vcpu_get_sregs(vm, vcpu, &sregs) == 0) {
-		sregs.cr0 |= CR0_PG;
-		sregs.cr4 |= CR4_PSE;
-		sregs.cr3 = pdir;
+	sregs = vcpu_state_sregs(state);
+	if (sregs != NULL) {
+		sregs->cr0 |= CR0_PG;
+		sregs->cr4 |= CR4_PSE;
+		sregs->cr3 = pdir;
 
-		pd = vm_get_memory(vm, pdir, PAGE_SIZE);
+		pd = vm_get_memory(state->vm, pdir, PAGE_SIZE);
 		if (pd != NULL) {
 			/* Initialize identity mapping */
 			for (i = 0; i < 1024; i++)
 				pd[i] = (i << 22) | PDE_PS | PDE_S | PDE_RWP;
 
-			if (vcpu_set_sregs(vm, vcpu, &sregs) == 0)
+			return 0;
+		}
+	}
+
+	errorx("failed to enable paging mode on VCPU #%u", state->vcpu);
+
+	return -1;
+}
+
+/**
+ * guest_xcr0() - compute XCR0 value enabling user state components, that
+ *                are exposed through virtual CPU CPUID
+ *
+ * @vm: virtual machine descriptor
+ *
+ * Return: XCR0 value
+ */
+static uint64_t guest_xcr0(struct vm *vm)
+{
+	const struct kvm_cpuid_entry2 *e;
+	uint64_t xcr0;
+
+	e = vm_get_cpuid(vm, CPUID_XSTATE, 0);
+	if (e == NULL)
+		return XCR0_X87;
+
+	/* Supervisor and dynamically enabled components stay disabled */
+	xcr0 = ((uint64_t) e->edx << 32 | e->eax) &
+	    (XCR0_X87 | XCR0_SSE | XCR0_AVX | XCR0_AVX512);
+
+	/* Keep state of masked out instruction sets disabled */
+	e = vm_get_cpuid(vm, CPUID_FEATURES, 0);
+	if (e == NULL || (e->ecx & CPUID_1_ECX_AVX) == 0)
+		xcr0 &= ~(uint64_t) (XCR0_AVX | XCR0_AVX512);
+
+	e = vm_get_cpuid(vm, CPUID_EXTENDED, 0);
+	if (e == NULL || (e->ebx & CPUID_7_EBX_AVX512F) == 0)
+		xcr0 &= ~(uint64_t) XCR0_AVX512;
+
+	return xcr0 | XCR0_X87;
+}
+
+/**
+ * vcpu_enable_simd() - enable SSE and, when exposed through CPUID, XSAVE
+ *                      managed AVX state on a virtual CPU
+ *
+ * @state: virtual CPU state to enable SIMD in
+ *
+ * Return: zero on success, or -1 if an error occurred
+ */
+int vcpu_enable_simd(struct vcpu_state *state)
+{
+	const struct kvm_cpuid_entry2 *e;
+	struct kvm_sregs *sregs;
+	struct kvm_xcrs *xcrs;
+	unsigned i;
+
+	e = vm_get_cpuid(state->vm, CPUID_FEATURES, 0);
+	sregs = vcpu_state_sregs(state);
+	if (e != NULL && sregs != NULL) {
+		sregs->cr0 = (sregs->cr0 & ~(uint64_t) CR0_EM) | CR0_MP;
+
+		if ((e->edx & CPUID_1_EDX_FXSR) != 0)
+			sregs->cr4 |= CR4_OSFXSR | CR4_OSXMMEXCPT;
+
+		if ((e->ecx & CPUID_1_ECX_XSAVE) == 0)
+			return 0;
+
+		sregs->cr4 |= CR4_OSXSAVE;
+
+		xcrs = vcpu_state_xcrs(state);
+		if (xcrs != NULL) {
+			for (i = 0; i < xcrs->nr_xcrs; i++)
+				if (xcrs->xcrs[i].xcr == 0)
+					break;
+
+			if (i == xcrs->nr_xcrs && i < KVM_MAX_XCRS)
+				xcrs->nr_xcrs++;
+
+			if (i < xcrs->nr_xcrs) {
+				xcrs->xcrs[i].xcr = 0;
+				xcrs->xcrs[i].value = guest_xcr0(state->vm);
+
 				return 0;
+			}
 		}
 	}
 
-	errorx("failed to enable paging mode on VCPU #%u", vcpu);
+	errorx("failed to enable SIMD on VCPU #%u", state->vcpu);
 
 	return -1;
 }
+
+/**
+ * vcpu_enable_kvmclock() - point a virtual CPU kvmclock at its time
+ *                          information, if exposed through CPUID
+ *
+ * MSR is written straight away rather than batched, as KVM fills the time
+ * information in as soon as it is set.
+ *
+ * @vm:   virtual machine descriptor
+ * @vcpu: virtual CPU identifier
+ * @gpa:  guest physical address of PVCLOCK_SIZE bytes of time information
+ *
+ * Return: zero on success, or -1 if an error occurred
+ */
+int vcpu_enable_kvmclock(struct vm *vm, unsigned vcpu, uintptr_t gpa)
+{
+	const struct kvm_cpuid_entry2 *e;
+
+	assert(vm != NULL);
+	assert(gpa % PVCLOCK_SIZE == 0);
+
+	/* Guests without kvmclock keep using TSC and PIT as they are */
+	e = vm_get_cpuid(vm, CPUID_KVM_FEATURES, 0);
+	if (e == NULL || (e->eax & CPUID_KVM_CLOCKSOURCE2) == 0)
+		return 0;
+
+	if (vm_get_memory(vm, gpa, PVCLOCK_SIZE) == NULL ||
+	    vcpu_set_msr(vm, vcpu, MSR_KVM_SYSTEM_TIME_NEW,
+			 gpa | KVM_SYSTEM_TIME_ENABLE) != 0) {
+		errorx("failed to enable kvmclock on VCPU #%u", vcpu);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * vcpu_save() - save complete state of a stopped virtual CPU
+ *
+ * @vm:   virtual machine descriptor
+ * @vcpu: virtual CPU identifier
+ * @snap: where to store virtual CPU state
+ *
+ * Return: zero on success, or -1 if an error occurred
+ */
+int vcpu_save(struct vm *vm, unsigned vcpu, struct vcpu_snapshot *snap)
+{
+	unsigned i;
+
+	assert(vm != NULL);
+	assert(snap != NULL);
+
+	if (vcpu_get_regs(vm, vcpu, &snap->regs) != 0 ||
+	    vcpu_get_sregs(vm, vcpu, &snap->sregs) != 0 ||
+	    vcpu_get_xcrs(vm, vcpu, &snap->xcrs) != 0 ||
+	    vcpu_get_xsave(vm, vcpu, &snap->xsave) != 0)
+		return -1;
+
+	for (i = 0; i < VCPU_NUM_MSRS; i++)
+		if (vcpu_get_msr(vm, vcpu, vcpu_msrs[i], &snap->msr[i]) != 0)
+			return -1;
+
+	return 0;
+}
+
+/**
+ * vcpu_load() - load complete state into a stopped virtual CPU
+ *
+ * @vm:   virtual machine descriptor
+ * @vcpu: virtual CPU identifier
+ * @snap: virtual CPU state saved by vcpu_save()
+ *
+ * Return: zero on success, or -1 if an error occurred
+ */
+int vcpu_load(struct vm *vm, unsigned vcpu, const struct vcpu_snapshot *snap)
+{
+	unsigned i;
+
+	assert(vm != NULL);
+	assert(snap != NULL);
+
+	/* XCR0 has to be restored before the state it enables */
+	if (vcpu_set_regs(vm, vcpu, &snap->regs) != 0 ||
+	    vcpu_set_sregs(vm, vcpu, &snap->sregs) != 0 ||
+	    vcpu_set_xcrs(vm, vcpu, &snap->xcrs) != 0 ||
+	    vcpu_set_xsave(vm, vcpu, &snap->xsave) != 0)
+		return -1;
+
+	/* kvmclock time information is refreshed on MSR write */
+	for (i = 0; i < VCPU_NUM_MSRS; i++)
+		if (vcpu_set_msr(vm, vcpu, vcpu_msrs[i], snap->msr[i]) != 0)
+			return -1;
+
+	return 0;
+}
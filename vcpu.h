@@ -3,19 +3,94 @@
 
 #include <stdint.h>
 
+#include <linux/kvm.h>
+
 struct vm;
 
 /**
  * enum
  *
- * @BOOT_VCPU: default bootstrap virtual CPU ID
+ * @BOOT_VCPU:               default bootstrap virtual CPU ID
+ * @PVCLOCK_SIZE:            size and alignment of per-VCPU kvmclock time
+ *                           information
+ * @MSR_KVM_SYSTEM_TIME_NEW: kvmclock time information address MSR
+ * @VCPU_NUM_MSRS:           number of model specific registers in
+ *                           vcpu_msrs
+ */
+enum {
+	BOOT_VCPU               = 0,
+	PVCLOCK_SIZE            = 32,
+	MSR_KVM_SYSTEM_TIME_NEW = 0x4b564d01,
+	VCPU_NUM_MSRS           = 1,
+};
+
+/**
+ * enum - virtual CPU state register sets
+ *
+ * @VCPU_STATE_REGS:  general purpose registers
+ * @VCPU_STATE_SREGS: special registers
+ * @VCPU_STATE_XCRS:  extended control registers
  */
 enum {
-	BOOT_VCPU = 0,
+	VCPU_STATE_REGS  = 1 << 0,
+	VCPU_STATE_SREGS = 1 << 1,
+	VCPU_STATE_XCRS  = 1 << 2,
+};
+
+/**
+ * struct vcpu_state - batched virtual CPU state update
+ *
+ * Register sets are fetched from the virtual CPU on first access, and every
+ * fetched set is written back once by vcpu_state_commit().
+ *
+ * @vm:     virtual machine descriptor
+ * @vcpu:   virtual CPU identifier
+ * @loaded: VCPU_STATE_* bits of register sets fetched so far
+ * @regs:   general purpose registers
+ * @sregs:  special registers
+ * @xcrs:   extended control registers
+ */
+struct vcpu_state {
+	struct vm *vm;
+	unsigned vcpu;
+	unsigned loaded;
+	struct kvm_regs regs;
+	struct kvm_sregs sregs;
+	struct kvm_xcrs xcrs;
+};
+
+/**
+ * struct vcpu_snapshot - complete virtual CPU state, as carried over by
+ *                        migration and snapshots
+ *
+ * @regs:  general purpose registers
+ * @sregs: special registers
+ * @xcrs:  extended control registers
+ * @xsave: extended processor state
+ * @msr:   values of vcpu_msrs
+ */
+struct vcpu_snapshot {
+	struct kvm_regs regs;
+	struct kvm_sregs sregs;
+	struct kvm_xcrs xcrs;
+	struct kvm_xsave xsave;
+	uint64_t msr[VCPU_NUM_MSRS];
 };
 
-int vcpu_init(struct vm *, unsigned, uintptr_t, uintptr_t);
-int vcpu_enable_protected_mode(struct vm *, unsigned);
-int vcpu_enable_paged_mode(struct vm *, unsigned, uintptr_t);
+extern const uint32_t vcpu_msrs[VCPU_NUM_MSRS];
+
+void vcpu_state_begin(struct vcpu_state *, struct vm *, unsigned);
+struct kvm_regs *vcpu_state_regs(struct vcpu_state *);
+struct kvm_sregs *vcpu_state_sregs(struct vcpu_state *);
+struct kvm_xcrs *vcpu_state_xcrs(struct vcpu_state *);
+int vcpu_state_commit(struct vcpu_state *);
+
+int vcpu_init(struct vcpu_state *, uintptr_t, uintptr_t);
+int vcpu_enable_protected_mode(struct vcpu_state *);
+int vcpu_enable_paged_mode(struct vcpu_state *, uintptr_t);
+int vcpu_enable_simd(struct vcpu_state *);
+int vcpu_enable_kvmclock(struct vm *, unsigned, uintptr_t);
+int vcpu_save(struct vm *, unsigned, struct vcpu_snapshot *);
+int vcpu_load(struct vm *, unsigned, const struct vcpu_snapshot *);
 
 #endif /* _VCPU_H */